@@ -24,6 +24,7 @@
 
 #include <algorithm>
 #include <cmath>
+#include <cstddef>
 #include <cstdlib>
 #include <cstring>
 #include <fstream>
@@ -33,6 +34,16 @@
 #include <string>
 #include <vector>
 
+#if defined(__unix__) || defined(__APPLE__)
+#define BITMAP_IMAGE_MMAP 1
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#else
+#define BITMAP_IMAGE_MMAP 0
+#endif
+
 
 class bitmap_image
 {
@@ -49,6 +60,11 @@ public:
                        red_plane   = 2
                     };
 
+   enum load_mode {
+                     copy_mode   = 0,
+                     mapped_mode = 1
+                  };
+
    struct rgb_t
    {
       unsigned char   red;
@@ -62,7 +78,11 @@ public:
      height_         (0),
      row_increment_  (0),
      bytes_per_pixel_(3),
-     channel_mode_(bgr_mode)
+     channel_mode_(bgr_mode),
+     view_           (0),
+     view_stride_    (0),
+     map_addr_       (0),
+     map_size_       (0)
    {}
 
    bitmap_image(const std::string& filename)
@@ -71,18 +91,69 @@ public:
      height_         (0),
      row_increment_  (0),
      bytes_per_pixel_(0),
-     channel_mode_(bgr_mode)
+     channel_mode_(bgr_mode),
+     view_           (0),
+     view_stride_    (0),
+     map_addr_       (0),
+     map_size_       (0)
    {
       load_bitmap();
    }
 
+   bitmap_image(const std::string& filename, const load_mode mode)
+   : file_name_(filename),
+     width_          (0),
+     height_         (0),
+     row_increment_  (0),
+     bytes_per_pixel_(0),
+     channel_mode_(bgr_mode),
+     view_           (0),
+     view_stride_    (0),
+     map_addr_       (0),
+     map_size_       (0)
+   {
+      /*
+         mapped_mode maps the file instead of reading it. Only the
+         pages of the rows that are actually touched get read, rows
+         stay in the file's bottom-up order behind row(). The mapping
+         is private, pixel edits never reach the file.
+      */
+      if (mapped_mode == mode)
+         map_bitmap();
+      else
+         load_bitmap();
+   }
+
+   bitmap_image(unsigned char* pixels, const unsigned int width, const unsigned int height)
+   : file_name_(""),
+     width_          (width ),
+     height_         (height),
+     row_increment_  (width * 3),
+     bytes_per_pixel_(3),
+     channel_mode_(bgr_mode),
+     view_           (pixels),
+     view_stride_    (static_cast<std::ptrdiff_t>(width) * 3),
+     map_addr_       (0),
+     map_size_       (0)
+   {
+      /*
+         Borrows width x height BGR pixels, top row first and rows back
+         to back. Nothing is copied or freed, the buffer must outlive
+         the image.
+      */
+   }
+
    bitmap_image(const unsigned int width, const unsigned int height)
    : file_name_(""),
      width_ (width ),
      height_(height),
      row_increment_  (0),
      bytes_per_pixel_(3),
-     channel_mode_(bgr_mode)
+     channel_mode_(bgr_mode),
+     view_           (0),
+     view_stride_    (0),
+     map_addr_       (0),
+     map_size_       (0)
    {
       create_bitmap();
    }
@@ -93,10 +164,35 @@ public:
      height_   (image.height_   ),
      row_increment_  (0),
      bytes_per_pixel_(3),
-     channel_mode_(bgr_mode)
+     channel_mode_(bgr_mode),
+     view_           (0),
+     view_stride_    (0),
+     map_addr_       (0),
+     map_size_       (0)
    {
       create_bitmap();
-      data_ = image.data_;
+      copy_rows(image);
+   }
+
+   bitmap_image(bitmap_image&& image)
+   : file_name_      (std::move(image.file_name_)),
+     width_          (image.width_          ),
+     height_         (image.height_         ),
+     row_increment_  (image.row_increment_  ),
+     bytes_per_pixel_(image.bytes_per_pixel_),
+     channel_mode_   (image.channel_mode_   ),
+     data_           (std::move(image.data_)),
+     view_           (image.view_           ),
+     view_stride_    (image.view_stride_    ),
+     map_addr_       (image.map_addr_       ),
+     map_size_       (image.map_size_       )
+   {
+      image.forget();
+   }
+
+  ~bitmap_image()
+   {
+      release();
    }
 
    bitmap_image& operator=(const bitmap_image& image)
@@ -110,15 +206,70 @@ public:
          row_increment_   = 0;
          channel_mode_    = image.channel_mode_;
          create_bitmap();
-         data_ = image.data_;
+         copy_rows(image);
       }
 
       return *this;
    }
 
+   bitmap_image& operator=(bitmap_image&& image)
+   {
+      if (this != &image)
+      {
+         release();
+         file_name_       = std::move(image.file_name_);
+         width_           = image.width_;
+         height_          = image.height_;
+         row_increment_   = image.row_increment_;
+         bytes_per_pixel_ = image.bytes_per_pixel_;
+         channel_mode_    = image.channel_mode_;
+         data_            = std::move(image.data_);
+         view_            = image.view_;
+         view_stride_     = image.view_stride_;
+         map_addr_        = image.map_addr_;
+         map_size_        = image.map_size_;
+         image.forget();
+      }
+
+      return *this;
+   }
+
+   // true when the pixels are borrowed or mapped rather than owned
+   inline bool is_view() const
+   {
+      return (0 != view_);
+   }
+
+   /*
+      true when data() to end() holds every row back to back, top row
+      first. A mapped file keeps its padded bottom-up rows, so the
+      whole-buffer methods (channel edits, import/export, subsample,
+      upsample, ...) refuse it with an error (see whole_buffer()).
+      Copy it into an owned image or go through row() instead.
+   */
+   inline bool contiguous() const
+   {
+      return (0 == view_) || (view_stride_ == static_cast<std::ptrdiff_t>(row_increment_));
+   }
+
+   /*
+      called first by every whole-buffer method, reports a view that is
+      not contiguous() on std::cerr so the misuse is not silent, the
+      method then leaves the image untouched
+   */
+   inline bool whole_buffer(const char* method) const
+   {
+      if (contiguous())
+         return true;
+
+      std::cerr << "bitmap_image::" << method << "() ERROR: bitmap_image - mapped view of " << file_name_
+                << " is not contiguous, copy it into an owned image first" << std::endl;
+      return false;
+   }
+
    inline bool operator!()
    {
-      return (data_.size()   == 0) ||
+      return ((view_ == 0) && (data_.size() == 0)) ||
              (width_         == 0) ||
              (height_        == 0) ||
              (row_increment_ == 0);
@@ -126,41 +277,50 @@ public:
 
    inline void clear(const unsigned char v = 0x00)
    {
-      std::fill(data_.begin(), data_.end(), v);
+      if (view_)
+      {
+         for (unsigned int y = 0; y < height_; ++y)
+            std::fill(row(y), row(y) + row_increment_, v);
+      }
+      else
+         std::fill(data_.begin(), data_.end(), v);
    }
 
    inline unsigned char red_channel(const unsigned int x, const unsigned int y) const
    {
-      return data_[(y * row_increment_) + (x * bytes_per_pixel_ + 2)];
+      return row(y)[x * bytes_per_pixel_ + 2];
    }
 
    inline unsigned char green_channel(const unsigned int x, const unsigned int y) const
    {
-      return data_[(y * row_increment_) + (x * bytes_per_pixel_ + 1)];
+      return row(y)[x * bytes_per_pixel_ + 1];
    }
 
    inline unsigned char blue_channel (const unsigned int x, const unsigned int y) const
    {
-      return data_[(y * row_increment_) + (x * bytes_per_pixel_ + 0)];
+      return row(y)[x * bytes_per_pixel_ + 0];
    }
 
    inline void red_channel(const unsigned int x, const unsigned int y, const unsigned char value)
    {
-      data_[(y * row_increment_) + (x * bytes_per_pixel_ + 2)] = value;
+      row(y)[x * bytes_per_pixel_ + 2] = value;
    }
 
    inline void green_channel(const unsigned int x, const unsigned int y, const unsigned char value)
    {
-      data_[(y * row_increment_) + (x * bytes_per_pixel_ + 1)] = value;
+      row(y)[x * bytes_per_pixel_ + 1] = value;
    }
 
    inline void blue_channel (const unsigned int x, const unsigned int y, const unsigned char value)
    {
-      data_[(y * row_increment_) + (x * bytes_per_pixel_ + 0)] = value;
+      row(y)[x * bytes_per_pixel_ + 0] = value;
    }
 
    inline unsigned char* row(unsigned int row_index) const
    {
+      if (view_)
+         return view_ + static_cast<std::ptrdiff_t>(row_index) * view_stride_;
+
       return const_cast<unsigned char*>(&data_[(row_index * row_increment_)]);
    }
 
@@ -169,13 +329,11 @@ public:
                          unsigned char& green,
                          unsigned char& blue) const
    {
-      const unsigned int y_offset = y * row_increment_;
-      const unsigned int x_offset = x * bytes_per_pixel_;
-      const unsigned int offset   = y_offset + x_offset;
+      const unsigned char* pixel = row(y) + x * bytes_per_pixel_;
 
-      blue  = data_[offset + 0];
-      green = data_[offset + 1];
-      red   = data_[offset + 2];
+      blue  = pixel[0];
+      green = pixel[1];
+      red   = pixel[2];
    }
 
    template <typename RGB>
@@ -196,13 +354,11 @@ public:
                          const unsigned char green,
                          const unsigned char blue)
    {
-      const unsigned int y_offset = y * row_increment_;
-      const unsigned int x_offset = x * bytes_per_pixel_;
-      const unsigned int offset   = y_offset + x_offset;
+      unsigned char* pixel = row(y) + x * bytes_per_pixel_;
 
-      data_[offset + 0] = blue;
-      data_[offset + 1] = green;
-      data_[offset + 2] = red;
+      pixel[0] = blue;
+      pixel[1] = green;
+      pixel[2] = red;
    }
 
    template <typename RGB>
@@ -221,7 +377,7 @@ public:
          return false;
       }
 
-      data_ = image.data_;
+      copy_rows(image);
 
       return true;
    }
@@ -416,6 +572,15 @@ public:
                                const unsigned int height,
                                const bool clear = false)
    {
+      // a view of the right size is kept, so results can be written into borrowed memory
+      if (view_ && (width == width_) && (height == height_))
+      {
+         if (clear)
+            this->clear();
+         return;
+      }
+
+      release();
       data_.clear();
       width_  = width;
       height_ = height;
@@ -438,11 +603,34 @@ public:
          return;
       }
 
+      save_header(stream, width_, height_);
+
+      unsigned int padding = (4 - ((3 * width_) % 4)) % 4;
+      char padding_data[4] = { 0x00, 0x00, 0x00, 0x00 };
+
+      for (unsigned int i = 0; i < height_; ++i)
+      {
+         const unsigned char* data_ptr = row(height_ - i - 1);
+
+         stream.write(reinterpret_cast<const char*>(data_ptr), sizeof(unsigned char) * bytes_per_pixel_ * width_);
+         stream.write(padding_data,padding);
+      }
+
+      stream.close();
+   }
+
+   inline void save_header(std::ofstream& stream, const unsigned int width, const unsigned int height) const
+   {
+      /*
+         Writes the file + information headers of a 24-bit bitmap.
+         Lets callers stream (height - 1 ... 0) padded rows themselves
+         without holding the whole image in memory.
+      */
       bitmap_information_header bih;
 
-      bih.width            = width_;
-      bih.height           = height_;
-      bih.bit_count        = static_cast<unsigned short>(bytes_per_pixel_ << 3);
+      bih.width            = width;
+      bih.height           = height;
+      bih.bit_count        = static_cast<unsigned short>(3 << 3);
       bih.clr_important    = 0;
       bih.clr_used         = 0;
       bih.compression      = 0;
@@ -450,7 +638,7 @@ public:
       bih.size             = bih.struct_size();
       bih.x_pels_per_meter = 0;
       bih.y_pels_per_meter = 0;
-      bih.size_image       = (((bih.width * bytes_per_pixel_) + 3) & 0x0000FFFC) * bih.height;
+      bih.size_image       = (((bih.width * 3) + 3) & ~0x00000003u) * bih.height;
 
       bitmap_file_header bfh;
 
@@ -462,23 +650,13 @@ public:
 
       write_bfh(stream,bfh);
       write_bih(stream,bih);
-
-      unsigned int padding = (4 - ((3 * width_) % 4)) % 4;
-      char padding_data[4] = { 0x00, 0x00, 0x00, 0x00 };
-
-      for (unsigned int i = 0; i < height_; ++i)
-      {
-         const unsigned char* data_ptr = &data_[(row_increment_ * (height_ - i - 1))];
-
-         stream.write(reinterpret_cast<const char*>(data_ptr), sizeof(unsigned char) * bytes_per_pixel_ * width_);
-         stream.write(padding_data,padding);
-      }
-
-      stream.close();
    }
 
    inline void set_all_ith_bits_low(const unsigned int bitr_index)
    {
+      if (!whole_buffer("set_all_ith_bits_low"))
+         return;
+
       unsigned char mask = static_cast<unsigned char>(~(1 << bitr_index));
 
       for (unsigned char* itr = data(); itr != end(); ++itr)
@@ -489,6 +667,9 @@ public:
 
    inline void set_all_ith_bits_high(const unsigned int bitr_index)
    {
+      if (!whole_buffer("set_all_ith_bits_high"))
+         return;
+
       unsigned char mask = static_cast<unsigned char>(1 << bitr_index);
 
       for (unsigned char* itr = data(); itr != end(); ++itr)
@@ -499,6 +680,9 @@ public:
 
    inline void set_all_ith_channels(const unsigned int& channel, const unsigned char& value)
    {
+      if (!whole_buffer("set_all_ith_channels"))
+         return;
+
       for (unsigned char* itr = (data() + channel); itr < end(); itr += bytes_per_pixel_)
       {
          *itr = value;
@@ -507,6 +691,9 @@ public:
 
    inline void set_channel(const color_plane color,const unsigned char& value)
    {
+      if (!whole_buffer("set_channel"))
+         return;
+
       for (unsigned char* itr = (data() + offset(color)); itr < end(); itr += bytes_per_pixel_)
       {
          *itr = value;
@@ -515,6 +702,9 @@ public:
 
    inline void ror_channel(const color_plane color, const unsigned int& ror)
    {
+      if (!whole_buffer("ror_channel"))
+         return;
+
       for (unsigned char* itr = (data() + offset(color)); itr < end(); itr += bytes_per_pixel_)
       {
          *itr = static_cast<unsigned char>(((*itr) >> ror) | ((*itr) << (8 - ror)));
@@ -523,6 +713,9 @@ public:
 
    inline void set_all_channels(const unsigned char& value)
    {
+      if (!whole_buffer("set_all_channels"))
+         return;
+
       for (unsigned char* itr = data(); itr < end(); )
       {
          *(itr++) = value;
@@ -533,6 +726,9 @@ public:
                                 const unsigned char& g_value,
                                 const unsigned char& b_value)
    {
+      if (!whole_buffer("set_all_channels"))
+         return;
+
       for (unsigned char* itr = (data() + 0); itr < end(); itr += bytes_per_pixel_)
       {
          *(itr + 0) = b_value;
@@ -543,11 +739,17 @@ public:
 
    inline void invert_color_planes()
    {
+      if (!whole_buffer("invert_color_planes"))
+         return;
+
       for (unsigned char* itr = data(); itr < end(); *itr = ~(*itr), ++itr);
    }
 
    inline void add_to_color_plane(const color_plane color, const unsigned char& value)
    {
+      if (!whole_buffer("add_to_color_plane"))
+         return;
+
       for (unsigned char* itr = (data() + offset(color)); itr < end(); itr += bytes_per_pixel_)
       {
          (*itr) += value;
@@ -556,6 +758,9 @@ public:
 
    inline void convert_to_grayscale()
    {
+      if (!whole_buffer("convert_to_grayscale"))
+         return;
+
       double r_scaler = 0.299;
       double g_scaler = 0.587;
       double b_scaler = 0.114;
@@ -580,14 +785,44 @@ public:
       }
    }
 
+   /*
+      data() to end() holds every row back to back for owned and
+      borrowed images. A mapped file keeps its padded bottom-up rows,
+      use row() there (see contiguous()).
+   */
    inline const unsigned char* data() const
    {
-      return data_.data();
+      return view_ ? row(0) : data_.data();
    }
 
    inline unsigned char* data()
    {
-      return const_cast<unsigned char*>(data_.data());
+      return view_ ? row(0) : const_cast<unsigned char*>(data_.data());
+   }
+
+   inline void advise_rows(const unsigned int first_row, const unsigned int rows) const
+   {
+      /*
+         Hints that rows [first_row, first_row + rows) are about to be
+         read so a mapped file can start paging them in. Does nothing
+         for other images.
+      */
+      #if BITMAP_IMAGE_MMAP
+      if (!map_addr_ || !rows || (first_row + rows > height_))
+         return;
+
+      const unsigned char* lo = std::min(row(first_row), row(first_row + rows - 1));
+      const unsigned char* hi = std::max(row(first_row), row(first_row + rows - 1)) + row_increment_;
+      const std::size_t    page = static_cast<std::size_t>(sysconf(_SC_PAGESIZE));
+      const std::size_t    start = (static_cast<std::size_t>(lo - static_cast<unsigned char*>(map_addr_)) / page) * page;
+
+      madvise(static_cast<unsigned char*>(map_addr_) + start,
+              static_cast<std::size_t>(hi - static_cast<unsigned char*>(map_addr_)) - start,
+              MADV_WILLNEED);
+      #else
+      (void)first_row;
+      (void)rows;
+      #endif
    }
 
    inline void bgr_to_rgb()
@@ -610,6 +845,9 @@ public:
 
    inline void reverse()
    {
+      if (!whole_buffer("reverse"))
+         return;
+
       unsigned char* itr1 = data();
       unsigned char* itr2 = end() - bytes_per_pixel_;
 
@@ -667,6 +905,9 @@ public:
 
    inline void export_color_plane(const color_plane color, unsigned char* image)
    {
+      if (!whole_buffer("export_color_plane"))
+         return;
+
       for (unsigned char* itr = (data() + offset(color)); itr < end(); ++image, itr += bytes_per_pixel_)
       {
          (*image) = (*itr);
@@ -675,6 +916,9 @@ public:
 
    inline void export_color_plane(const color_plane color, bitmap_image& image)
    {
+      if (!whole_buffer("export_color_plane") || !image.whole_buffer("export_color_plane"))
+         return;
+
       if (
            (width_  != image.width_ ) ||
            (height_ != image.height_)
@@ -700,6 +944,9 @@ public:
 
    inline void export_response_image(const color_plane color, double* response_image)
    {
+      if (!whole_buffer("export_response_image"))
+         return;
+
       double* resp_itr = response_image;
 
       for (unsigned char* itr = (data() + offset(color)); itr < end(); ++response_image, itr += bytes_per_pixel_)
@@ -710,6 +957,9 @@ public:
 
    inline void export_gray_scale_response_image(double* response_image) const
    {
+      if (!whole_buffer("export_gray_scale_response_image"))
+         return;
+
       double* resp_itr = response_image;
 
       for (const unsigned char* itr = data(); itr < end(); itr += bytes_per_pixel_)
@@ -727,6 +977,9 @@ public:
 
    inline void export_rgb(double* red, double* green, double* blue) const
    {
+      if (!whole_buffer("export_rgb"))
+         return;
+
       if (bgr_mode != channel_mode_)
          return;
 
@@ -740,6 +993,9 @@ public:
 
    inline void export_rgb(float* red, float* green, float* blue) const
    {
+      if (!whole_buffer("export_rgb"))
+         return;
+
       if (bgr_mode != channel_mode_)
          return;
 
@@ -753,6 +1009,9 @@ public:
 
    inline void export_rgb(unsigned char* red, unsigned char* green, unsigned char* blue) const
    {
+      if (!whole_buffer("export_rgb"))
+         return;
+
       if (bgr_mode != channel_mode_)
          return;
 
@@ -766,6 +1025,9 @@ public:
 
    inline void export_ycbcr(double* y, double* cb, double* cr) const
    {
+      if (!whole_buffer("export_ycbcr"))
+         return;
+
       if (bgr_mode != channel_mode_)
          return;
 
@@ -783,6 +1045,9 @@ public:
 
    inline void export_rgb_normal(double* red, double* green, double* blue) const
    {
+      if (!whole_buffer("export_rgb_normal"))
+         return;
+
       if (bgr_mode != channel_mode_)
          return;
 
@@ -796,6 +1061,9 @@ public:
 
    inline void export_rgb_normal(float* red, float* green, float* blue) const
    {
+      if (!whole_buffer("export_rgb_normal"))
+         return;
+
       if (bgr_mode != channel_mode_)
          return;
 
@@ -809,6 +1077,9 @@ public:
 
    inline void import_rgb(double* red, double* green, double* blue)
    {
+      if (!whole_buffer("import_rgb"))
+         return;
+
       if (bgr_mode != channel_mode_)
          return;
 
@@ -822,6 +1093,9 @@ public:
 
    inline void import_rgb(float* red, float* green, float* blue)
    {
+      if (!whole_buffer("import_rgb"))
+         return;
+
       if (bgr_mode != channel_mode_)
          return;
 
@@ -835,6 +1109,9 @@ public:
 
    inline void import_rgb(unsigned char* red, unsigned char* green, unsigned char* blue)
    {
+      if (!whole_buffer("import_rgb"))
+         return;
+
       if (bgr_mode != channel_mode_)
          return;
 
@@ -848,6 +1125,9 @@ public:
 
    inline void import_ycbcr(double* y, double* cb, double* cr)
    {
+      if (!whole_buffer("import_ycbcr"))
+         return;
+
       if (bgr_mode != channel_mode_)
          return;
 
@@ -865,6 +1145,9 @@ public:
 
    inline void import_gray_scale_clamped(double* gray)
    {
+      if (!whole_buffer("import_gray_scale_clamped"))
+         return;
+
       if (bgr_mode != channel_mode_)
          return;
 
@@ -882,6 +1165,9 @@ public:
 
    inline void import_rgb_clamped(double* red, double* green, double* blue)
    {
+      if (!whole_buffer("import_rgb_clamped"))
+         return;
+
       if (bgr_mode != channel_mode_)
          return;
 
@@ -895,6 +1181,9 @@ public:
 
    inline void import_rgb_clamped(float* red, float* green, float* blue)
    {
+      if (!whole_buffer("import_rgb_clamped"))
+         return;
+
       if (bgr_mode != channel_mode_)
          return;
 
@@ -908,6 +1197,9 @@ public:
 
    inline void import_rgb_normal(double* red, double* green, double* blue)
    {
+      if (!whole_buffer("import_rgb_normal"))
+         return;
+
       if (bgr_mode != channel_mode_)
          return;
 
@@ -921,6 +1213,9 @@ public:
 
    inline void import_rgb_normal(float* red, float* green, float* blue)
    {
+      if (!whole_buffer("import_rgb_normal"))
+         return;
+
       if (bgr_mode != channel_mode_)
          return;
 
@@ -937,6 +1232,10 @@ public:
       /*
          Half sub-sample of original image.
       */
+
+      if (!whole_buffer("subsample") || !dest.whole_buffer("subsample"))
+         return;
+
       unsigned int w = 0;
       unsigned int h = 0;
 
@@ -1066,6 +1365,9 @@ public:
          2x up-sample of original image.
       */
 
+      if (!whole_buffer("upsample") || !dest.whole_buffer("upsample"))
+         return;
+
       dest.setwidth_height(2 * width_ ,2 * height_);
       dest.clear();
 
@@ -1109,6 +1411,9 @@ public:
 
    inline void alpha_blend(const double& alpha, const bitmap_image& image)
    {
+      if (!whole_buffer("alpha_blend") || !image.whole_buffer("alpha_blend"))
+         return;
+
       if (
            (image.width_  != width_ ) ||
            (image.height_ != height_)
@@ -1146,18 +1451,23 @@ public:
          return 0.0;
       }
 
-      const unsigned char* itr1 = data();
-      const unsigned char* itr2 = image.data();
-
       double mse = 0.0;
 
-      while (itr1 != end())
+      // row by row, so mapped views are compared as well
+      for (unsigned int r = 0; r < height_; ++r)
       {
-         const double v = (static_cast<double>(*itr1) - static_cast<double>(*itr2));
+         const unsigned char* itr1     = row(r);
+         const unsigned char* itr1_end = itr1 + row_increment_;
+         const unsigned char* itr2     = image.row(r);
 
-         mse += v * v;
-         ++itr1;
-         ++itr2;
+         while (itr1 != itr1_end)
+         {
+            const double v = (static_cast<double>(*itr1) - static_cast<double>(*itr2));
+
+            mse += v * v;
+            ++itr1;
+            ++itr2;
+         }
       }
 
       if (mse <= 0.0000001)
@@ -1212,6 +1522,9 @@ public:
 
    inline void histogram(const color_plane color, double hist[256]) const
    {
+      if (!whole_buffer("histogram"))
+         return;
+
       std::fill(hist, hist + 256, 0.0);
 
       for (const unsigned char* itr = (data() + offset(color)); itr < end(); itr += bytes_per_pixel_)
@@ -1264,6 +1577,9 @@ public:
 
    inline void incremental()
    {
+      if (!whole_buffer("incremental"))
+         return;
+
       unsigned char current_color = 0;
 
       for (unsigned char* itr = data(); itr < end();)
@@ -1278,6 +1594,9 @@ public:
 
    inline void reverse_channels()
    {
+      if (!whole_buffer("reverse_channels"))
+         return;
+
       if (3 != bytes_per_pixel_)
          return;
 
@@ -1287,16 +1606,131 @@ public:
       }
    }
 
+   inline bool read_header(const std::string& file_name)
+   {
+      /*
+         Reads and validates only the 54 byte file + information
+         headers. width() and height() are valid afterwards but no
+         pixel data is allocated or read.
+      */
+      file_name_       = file_name;
+      width_           = 0;
+      height_          = 0;
+      row_increment_   = 0;
+      bytes_per_pixel_ = 0;
+      release();
+      data_.clear();
+
+      std::ifstream stream(file_name_.c_str(),std::ios::binary);
+
+      if (!stream)
+      {
+         std::cerr << "bitmap_image::read_header() ERROR: bitmap_image - file " << file_name_ << " not found!" << std::endl;
+         return false;
+      }
+
+      bitmap_file_header bfh;
+      bitmap_information_header bih;
+
+      bfh.clear();
+      bih.clear();
+
+      read_bfh(stream,bfh);
+      read_bih(stream,bih);
+
+      if (!stream)
+      {
+         std::cerr << "bitmap_image::read_header() ERROR: bitmap_image - file " << file_name_ << " is too short!" << std::endl;
+         return false;
+      }
+
+      if (bfh.type != 19778)
+      {
+         std::cerr << "bitmap_image::read_header() ERROR: bitmap_image - Invalid type value " << bfh.type << " expected 19778." << std::endl;
+         return false;
+      }
+
+      if (bih.bit_count != 24)
+      {
+         std::cerr << "bitmap_image::read_header() ERROR: bitmap_image - Invalid bit depth " << bih.bit_count << " expected 24." << std::endl;
+         return false;
+      }
+
+      if (bih.size != bih.struct_size())
+      {
+         std::cerr << "bitmap_image::read_header() ERROR: bitmap_image - Invalid BIH size " << bih.size << " expected " << bih.struct_size() << std::endl;
+         return false;
+      }
+
+      unsigned int padding = (4 - ((3 * bih.width) % 4)) % 4;
+
+      std::size_t bitmap_logical_size = (static_cast<std::size_t>(bih.height) * bih.width * (bih.bit_count >> 3)) +
+                                        (static_cast<std::size_t>(bih.height) * padding)                          +
+                                         bih.struct_size()                                                         +
+                                         bfh.struct_size()                                                         ;
+
+      stream.seekg(0, std::ios::end);
+      std::size_t bitmap_file_size = static_cast<std::size_t>(stream.tellg());
+
+      if (bitmap_file_size != bitmap_logical_size)
+      {
+         std::cerr << "bitmap_image::read_header() ERROR: bitmap_image - Mismatch between logical and physical sizes of bitmap. " <<
+                      "Logical: "  << bitmap_logical_size << " " <<
+                      "Physical: " << bitmap_file_size    << std::endl;
+         return false;
+      }
+
+      width_           = bih.width;
+      height_          = bih.height;
+      bytes_per_pixel_ = bih.bit_count >> 3;
+
+      return true;
+   }
+
 private:
 
    inline const unsigned char* end() const
    {
-      return data_.data() + data_.size();
+      return data() + static_cast<std::size_t>(height_) * row_increment_;
    }
 
    inline unsigned char* end()
    {
-      return const_cast<unsigned char*>(data() + data_.size());
+      return data() + static_cast<std::size_t>(height_) * row_increment_;
+   }
+
+   // drops a borrowed or mapped buffer, the image is owned (and empty) afterwards
+   inline void release()
+   {
+      #if BITMAP_IMAGE_MMAP
+      if (map_addr_)
+         munmap(map_addr_, map_size_);
+      #endif
+
+      view_        = 0;
+      view_stride_ = 0;
+      map_addr_    = 0;
+      map_size_    = 0;
+   }
+
+   // leaves a moved from image empty without freeing what it pointed to
+   inline void forget()
+   {
+      width_         = 0;
+      height_        = 0;
+      row_increment_ = 0;
+      data_.clear();
+      view_          = 0;
+      view_stride_   = 0;
+      map_addr_      = 0;
+      map_size_      = 0;
+   }
+
+   // copies pixels row by row, the source may be a view with any row order
+   inline void copy_rows(const bitmap_image& image)
+   {
+      for (unsigned int y = 0; y < height_; ++y)
+         std::copy(image.row(y), image.row(y) + row_increment_, row(y));
    }
 
    struct bitmap_file_header
@@ -1501,10 +1935,53 @@ private:
 
    void create_bitmap()
    {
+      release();
       row_increment_ = width_ * bytes_per_pixel_;
       data_.resize(height_ * row_increment_);
    }
 
+   void map_bitmap()
+   {
+      if (!read_header(file_name_) || !width_ || !height_)
+         return;
+
+      #if BITMAP_IMAGE_MMAP
+      int fd = open(file_name_.c_str(), O_RDONLY);
+      struct stat st;
+
+      if ((fd < 0) || (fstat(fd, &st) != 0))
+      {
+         if (fd >= 0)
+            close(fd);
+         load_bitmap();
+         return;
+      }
+
+      void* addr = mmap(0, static_cast<std::size_t>(st.st_size), PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+      close(fd);
+
+      if (MAP_FAILED == addr)
+      {
+         load_bitmap();
+         return;
+      }
+
+      bitmap_file_header bfh;
+      bitmap_information_header bih;
+
+      // read_header() checked the pixels follow the two headers, padded to 4 bytes per row
+      const std::size_t padded = ((static_cast<std::size_t>(width_) * bytes_per_pixel_) + 3) & ~static_cast<std::size_t>(3);
+
+      map_addr_      = addr;
+      map_size_      = static_cast<std::size_t>(st.st_size);
+      row_increment_ = width_ * bytes_per_pixel_;
+      view_          = static_cast<unsigned char*>(addr) + bfh.struct_size() + bih.struct_size() + padded * (height_ - 1);
+      view_stride_   = -static_cast<std::ptrdiff_t>(padded);
+      #else
+      load_bitmap();
+      #endif
+   }
+
    void load_bitmap()
    {
       std::ifstream stream(file_name_.c_str(),std::ios::binary);
@@ -1620,6 +2097,11 @@ private:
    unsigned int bytes_per_pixel_;
    channel_mode channel_mode_;
    std::vector<unsigned char> data_;
+   // borrowed or mapped pixels, 0 when data_ owns them
+   unsigned char* view_;
+   std::ptrdiff_t view_stride_;
+   void*          map_addr_;
+   std::size_t    map_size_;
 };
 
 typedef bitmap_image::rgb_t rgb_t;
@@ -17,6 +17,24 @@
  *		3) Set FILES
  *		4) Run the program and wait for an output image
  *
+ *		Most USER DEFINABLE VARIABLES and FILES can be overridden at run time (see config_set()):
+ *			mosaic --ref rainier.bmp --out out.bmp --dir img60 --tiles 100 --threads 8
+ *		A batch renders one mosaic per line of a job file, the library is indexed and cached once:
+ *			mosaic --dir img60 --batch jobs.txt
+ *			(jobs.txt lines look like: ref=rainier.bmp out=rainier_mosaic.bmp tiles=120)
+ *		Big mosaics can be split into tile row bands, one process (or node) per band, then merged:
+ *			mosaic --out /shared/big.bmp --shards 4 --shard 2	(writes /shared/big_shard2.bmp)
+ *			mosaic --out /shared/big.bmp --shards 4 --merge 1
+ *		A FILE_OUT ending in .png is written as a PNG, deflated one tile row strip per thread (link with -lz):
+ *			mosaic --ref rainier.bmp --out rainier_mosaic.png
+ *		A benchmark times every phase on its own and writes median/p95 times as JSON:
+ *			mosaic --synth 2000 --tiles 100 --bench 5
+ *			(--synth writes a reproducible library to BENCH_DIR, leave it out to benchmark the FILES)
+ *		Regression run for the tinted tile cache, a 1MB budget evicts tiles while other threads still
+ *		copy them (build with -fsanitize=address, must finish without reports and match a 4096MB run):
+ *			mosaic --synth 300 --bench 0
+ *			mosaic --ref /tmp/mosaic_bench/ref.bmp --dir /tmp/mosaic_bench/img --filter 1 --tint_cache_mb 1 --threads 8 --tiles 120
+ *
  *	Notes:
  *		- BMP files can be very very large (1.3GB for a 30,000 x 20,000 image)
  *		- BMP file resolution caps out for specific programs (30,000 pixels max for Windows Photo viewer)
@@ -46,16 +64,33 @@
 // https://github.com/tronkko/dirent/blob/master/examples/scandir.c
 
 
+#include <atomic>
+#include <cfloat>
 #include <cmath>
+#include <condition_variable>
 #include <cstdio>
 #include <cstdlib>
+#include <cstring>
 #include <iostream>
-
-//#include "bitmap_image.hpp"
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "bitmap_image.hpp"
 #include "mosaic.h"
 
 #include <omp.h>
 
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
 // these defines must change on a posix system
 // change the quotes to angle brackets on unix
 #if 0
@@ -69,12 +104,18 @@
 #include <time.h>
 #include <sys/time.h>
 #include <limits.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <fcntl.h>
+#include <unistd.h>
 
 #endif
 
 using namespace std;
 
-#define numthreads 4
+// threads used by every parallel phase (--threads), defaults to every core this process may use
+int numthreads = omp_get_num_procs();
 
 /***********************************************/
 /*************** DEBUG VARIABLES ***************/
@@ -84,7 +125,8 @@ using namespace std;
  * DEBUG PRINT LEVEL
  * 0: Critical Errors
  * 1: State + Summary
- * 2: Verbose
+ * 2: Verbose (per tile and per file, see dbglog())
+ * the level is fixed at compile time, per tile messages above it cost nothing
  */
 #define DEBUG 1
 
@@ -95,6 +137,14 @@ using namespace std;
  */
 #define TIMESTEPS 1
 
+/*
+ * TRACE
+ * 0: Off, every trace call compiles to nothing
+ * 1: Count ranking candidates, repeat check probes and pick depth, time the work of every
+ *    thread and write FILE_TRACE as a Chrome trace (chrome://tracing or ui.perfetto.dev)
+ */
+#define TRACE 0
+
 /*
 /* TEST LEVEL
 * 0: Output mosaic image, no testing code
@@ -102,10 +152,63 @@ using namespace std;
 */
 #define TEST 0
 
-// Enable filtering to match original image color
-// 0 gives no color since all the image weights counterbalance each other
-// 1 gives color
-#define FILTER 1
+/*
+ * RANK MODE
+ * 0: Full sort, every tile ranks every component up front (uses a lot of memory)
+ * 1: K-d tree, tiles ask for their next best component only when fitting needs it
+ * 2: Top-K, tiles keep only their RANK_TOP_K best components and refill on demand
+ */
+#define RANK_MODE 1
+
+/*
+ * FIT MODE
+ * 0: Greedy, every tile takes its best usable component, tiles fitted first get the best ones
+ * 1: Auction, tiles bid on their FIT_CANDIDATES best components, each component goes to the
+ *    TILE_RPT_COUNT tiles that gain the most from it (lower total color error, bounded rounds)
+ */
+#define FIT_MODE 0
+
+/*
+ * COLOR SPACE used to compare tiles against components
+ * 0: RGB, squared euclidean distance of the RMS weights
+ * 1: CIELAB, squared euclidean distance (closer to what we perceive, slightly slower setup)
+ */
+#define COLOR_SPACE 0
+
+/*
+ * WRITE MODE
+ * 0: Full canvas, a blank template is saved up front and reloaded for compositing
+ * 1: Streaming, the header is written first and then every tile row strip in file order
+ * 2: Mapped, FILE_OUT is sized up front and memory mapped, threads draw tiles straight into it
+ */
+#define WRITE_MODE 1
+
+/*
+ * PNG OUTPUT (link with -lz)
+ * 0: FILE_OUT is always written as a BMP
+ * 1: a FILE_OUT ending in .png is written as a PNG, every tile row strip is deflated by its own thread
+ *    (falls back to 0 when zlib.h is not installed)
+ */
+#define PNG_OUTPUT 1
+
+#if PNG_OUTPUT && defined(__has_include)
+#if !__has_include(<zlib.h>)
+#undef PNG_OUTPUT
+#define PNG_OUTPUT 0
+#endif
+#endif
+
+#if PNG_OUTPUT
+#include <zlib.h>
+#endif
+
+/*
+ * GPU OFFLOAD (OpenMP target regions, build with an offloading compiler, e.g. -foffload=nvptx-none)
+ * 0: everything runs on the host
+ * 1: RANK_MODE 2 top-K lists and the full size streamed BMP write are computed on the default
+ *    device, fitting stays on the host; without a device the same kernels run on the host
+ */
+#define GPU_OFFLOAD 0
 
 /***********************************************/
 /*************** USER DEFINABLE VARIABLES ******/
@@ -121,35 +224,128 @@ float ASP_RATIO_ERR = 0.01;
 // number of image tiles per ROW and COL
 int TILE_LDA = 142;
 
+// total number of tiles wanted, 0 uses the square TILE_LDA x TILE_LDA grid
+// rows and cols are chosen so tiles keep close to the components' own shape and the
+// mosaic matches the reference's aspect ratio (ASP_RATIO_ERR is not used)
+int TILE_COUNT = 0;
+
 // number of times we can repeat an image
 // a low number will result in no image or VERY slow code
 // the total # of titles is TILE_RPT_COUNT * N_COMPONENT_IMAGES
 int TILE_RPT_COUNT = 9;
 
 // minimum distance between same images
-// a high value will result in VERY slow code
+// the repeat check costs at most TILE_RPT_COUNT compares, but a high value can leave tiles with no usable image
 int TILE_MIN_DIST = 10;
 //the distance between repeated tiles (in every direction including in diagnols)
 
+// number of candidates kept per tile with RANK_MODE 2
+// memory is TOTAL_TILES * RANK_TOP_K entries, a tile that uses them all ranks its next RANK_TOP_K
+int RANK_TOP_K = 32;
+
+// candidates a tile lists at a time with FIT_MODE 1
+// a tile lists the next batch only when all of its listed ones have become too expensive
+int FIT_CANDIDATES = 16;
+// upper bound on auction bidding rounds, whatever is unassigned by then is fitted greedily
+int FIT_AUCTION_ROUNDS = 10000;
+
+// number of half size preview levels written before the full mosaic
+// 3 writes a mosaic with 1/8 size tiles first, then 1/4, then 1/2, 0 (the default) disables previews
+int PREVIEW_LEVELS = 0;
+
+// memory budget of the tinted tile cache in MB, 0 disables it
+// repeated placements of a component with a similar tint become a plain copy
+int TINT_CACHE_MB = 0;
+// tint colors are rounded to multiples of this while the tinted tile cache is on
+int TINT_CACHE_QUANT = 4;
+
+// tile rows composited on the device before they are copied back and written (GPU_OFFLOAD 1)
+int GPU_BAND_ROWS = 16;
+
+// zlib level of PNG output (1 fastest to 9 smallest)
+// strips are deflated in parallel, so higher levels cost little wall clock with enough threads
+int PNG_LEVEL = 6;
+
+// threads reading and decoding component images in the background
+// raise it for network mounted libraries where each read mostly waits on the server
+int IO_THREADS = 4;
+// decoded images the readers may get ahead of the weighing by (each is a full size image in memory)
+int IO_QUEUE_DEPTH = 16;
+
+// Enable filtering to match original image color
+// 0 gives no color since all the image weights counterbalance each other
+// 1 gives color
+int FILTER = 1;
+
 // filter strength
 // current tile's original image RGB contribution (gives our mosaics color)
+// tinting runs in 8.8 fixed point (tint_tile()), values other than 0.5 can give channels one
+// below or above what the old float blend gave, 0.5 (and 0 or 1) give the same output as before
 float FILTER_PERCENT = 0.5;
 //how much color you want to see. I use a simple filter based on highest RGB contribution so it's not exact.
 //Keeping it between 0.3 and 0.5 is pretty good. There's no performance cost for this
 
+// number of shards (tile row bands) the mosaic is split into, each rendered by its own process or node
+// every shard gets an even share of each component's TILE_RPT_COUNT and the first and last
+// TILE_MIN_DIST rows of a band only use odd or even components, so no rule is broken across bands
+int SHARD_COUNT = 1;
+// band this process renders, 0 is the top one
+int SHARD_INDEX = 0;
+// 1 to merge the SHARD_COUNT band files into FILE_OUT instead of rendering (see merge_shards())
+int SHARD_MERGE = 0;
+
+// benchmark repetitions of every phase, 0 renders normally (see bench_run())
+int BENCH_REPS = 0;
+// synthetic components written to BENCH_DIR before running, 0 benchmarks the FILES below
+// reruns with the same BENCH_SEED write the same library byte for byte
+int BENCH_COMPONENTS = 0;
+int BENCH_SEED = 1;
+// synthetic reference size in pixels
+int BENCH_REF_WIDTH = 1920;
+int BENCH_REF_HEIGHT = 1080;
+
 /*************************************/
 /*************** FILES ***************/
 /*************************************/
 
 // Reference file
-const string FILE_REF = "/Users/Raina/ClionProjects/mosics_parallel/_rotunda.bmp";
+string FILE_REF = "/Users/Raina/ClionProjects/mosics_parallel/_rotunda.bmp";
 
 // Output file
-const string FILE_OUT = "/Users/Raina/ClionProjects/mosics_parallel/mosaic.bmp";
+string FILE_OUT = "/Users/Raina/ClionProjects/mosics_parallel/mosaic.bmp";
 
 // Source directory of tile images
-//const char DIR_IMG_PATH[] = "img60";
-const char DIR_IMG_PATH[] = "/Users/Raina/ClionProjects/mosics_parallel/img60_2249";
+//string DIR_IMG_PATH = "img60";
+string DIR_IMG_PATH = "/Users/Raina/ClionProjects/mosics_parallel/img60_2249";
+
+// Component index (dimensions + weights of DIR_IMG_PATH kept between runs)
+// only new or changed files are probed and weighed again, empty string disables it
+string FILE_INDEX = DIR_IMG_PATH + ".idx";
+
+// Fit cache (placements of the last run on FILE_REF, see fit_cache_save())
+// a run whose tile colors, component colors and fit settings all match it skips ranking and
+// fitting, so changing only FILTER, FILTER_PERCENT or FILE_OUT just writes again
+// empty string disables it
+string FILE_FIT = FILE_REF + ".fit";
+
+// Rank cache (tile rankings of the last run on FILE_REF, see rank_cache_save())
+// a run with the same tile and component colors but other fit settings (TILE_RPT_COUNT,
+// TILE_MIN_DIST, ...) skips ranking and only fits again, RANK_MODE 1 ranks nothing up front
+// empty string disables it
+string FILE_RANK = FILE_REF + ".rank";
+
+// Batch job list, one mosaic per line of key=value settings (see config_set())
+// empty renders a single mosaic from the settings above
+string FILE_BATCH = "";
+
+// Synthetic library written for benchmarks (ref.bmp, img/ and mosaic.bmp go here)
+string BENCH_DIR = "/tmp/mosaic_bench";
+
+// Benchmark report, empty writes bench.json next to FILE_OUT
+string FILE_BENCH = "";
+
+// Trace written with TRACE 1, empty writes FILE_OUT with a .trace.json extension
+string FILE_TRACE = "";
 
 
 /***********************************************/
@@ -160,12 +356,74 @@ const char DIR_IMG_PATH[] = "/Users/Raina/ClionProjects/mosics_parallel/img60_22
 unsigned int cmp_img_min_width = UINT_MAX;
 unsigned int cmp_img_min_height = UINT_MAX;
 
-// list of tile image metadata
+// list of tile image metadata, only the paths and file stamps live here
 vector <component_metadata> components;
+// RMS weight and times placed of every component, split out of components for the rank and fit loops
+vector <rgb_t> component_rgb;
+vector <placed_counter> component_placed;
 int components_size;
+// directory components was listed from, a batch only lists it again when a job changes it
+string components_dir;
+
+// component index loaded from FILE_INDEX, keyed by full path
+unordered_map <string, component_index_entry> component_index;
+// crop size the stored weights were calculated at
+unsigned int component_index_width = 0;
+unsigned int component_index_height = 0;
+// set when the index on disk no longer matches the component list
+int component_index_dirty = 0;
 
 // sorted list of component images per tile by how much they are preferred
 vector <vector<mosaic_map>> tile_map;
+// fit_cache_layout_hash() of the tiles ranked last, a batch job that only changes the fit
+// settings keeps the ranking (0 for none), FILE_RANK keeps it between runs
+unsigned long long rank_hash = 0;
+
+// best RANK_TOP_K components of every tile, back to back (RANK_MODE 2)
+// tile t owns entries [t * RANK_TOP_K, (t + 1) * RANK_TOP_K)
+vector <mosaic_map> tile_top_k;
+// rank of the first entry currently held for each tile
+vector <int> tile_top_k_base;
+
+// component weights in COLOR_SPACE coordinates, one array per channel
+// a structure of arrays so the ranking kernel can score many components per instruction
+vector <float> cmp_color[3];
+
+// k-d tree over component colors (RANK_MODE 1)
+// node n is the split point of the subtree [lo, hi) with n = (lo + hi) / 2
+vector <kd_node> kd_tree;
+
+// component tile cache
+// every component is decoded once and cropped to cmp_width x cmp_height
+// pixels are stored back to back (BGR, top row first) in one arena
+vector <unsigned char> tile_cache;
+// bytes used by a single cropped component in the arena
+size_t tile_cache_stride = 0;
+// 1 once a component has been decoded into the arena
+// set by the loader threads, tile_cache_wait() sleeps on tile_cache_ready until it is
+vector <atomic<char>> tile_cache_loaded;
+mutex tile_cache_lock;
+condition_variable tile_cache_ready;
+
+// background loader, tile_loader_start() hands tile_loader_order out to IO_THREADS readers
+vector <thread> tile_loader_threads;
+vector <int> tile_loader_order;
+atomic<int> tile_loader_next(0);
+atomic<int> tile_loader_active(0);
+bounded_queue <decoded_component>* tile_loader_queue = NULL;
+
+// LRU cache of already tinted tiles, keyed by tint_cache_key()
+// buffers are shared, a tile evicted while another thread copies it stays valid as long as that thread holds its shared_ptr
+list <pair<unsigned long long, shared_ptr<const vector<unsigned char>>>> tint_cache_lru;
+unordered_map <unsigned long long, list<pair<unsigned long long, shared_ptr<const vector<unsigned char>>>>::iterator> tint_cache_map;
+size_t tint_cache_bytes = 0;
+long long tint_cache_hits = 0;
+long long tint_cache_misses = 0;
+mutex tint_cache_lock;
+
+// half size copies of the tile cache for previews, tile_pyramid[n] holds 1/2^n size tiles
+// level 0 is the tile cache itself and is left empty here
+vector <tile_level> tile_pyramid;
 
 
 /***********************************************/
@@ -176,9 +434,26 @@ int TOTAL_TILES = TILE_LDA * TILE_LDA;
 // mosaic info
 mosaic_metadata mosaic;
 
-// mosaic image mapping of tile images
-// when parallelized, this needs to have a lock on it
-vector <mosaic_tile> tiles;
+// tile rows [shard_row_begin, shard_row_end) are fitted and written by this process
+// the whole grid unless SHARD_COUNT > 1
+int shard_row_begin = 0;
+int shard_row_end = 0;
+
+// summed area tables of the reference image's squared channels
+// (width + 1) x (height + 1) entries of interleaved red, green, blue sums
+vector <unsigned long long> ref_sat;
+unsigned int ref_sat_width = 0;
+unsigned int ref_sat_height = 0;
+
+// mosaic image mapping of tile images, tile_x() and tile_y() give where a tile goes
+// average color of every tile and the component placed on it (-1 for none)
+vector <rgb_t> tile_rgb;
+vector <int32_t> tile_img;
+
+// tiles each component was placed on, TILE_RPT_COUNT slots per component
+// component n owns [n * TILE_RPT_COUNT, (n + 1) * TILE_RPT_COUNT), the first placed of them are used
+// placements past the limit (fallbacks) are not recorded, nothing can be checked against them
+vector <int> placed_tiles;
 
 
 /***********************************************/
@@ -188,15 +463,43 @@ vector <mosaic_tile> tiles;
 inline int min_n(int a, int b) { return a < b ? a : b; };
 inline int max_n(int a, int b) { return a > b ? a : b; };
 
+// top left pixel of a tile in the mosaic
+inline size_t tile_x(int tile_index) { return (size_t) (tile_index % mosaic.cols) * mosaic.cmp_width; }
+inline size_t tile_y(int tile_index) { return (size_t) (tile_index / mosaic.cols) * mosaic.cmp_height; }
+
 // debug print function
 // debug_level: level of print
 // text: text to be printed, newlines already included
-void dbgprint(int debug_level, string text)
+void dbgprint(int debug_level, const string& text)
 {
     if (debug_level <= DEBUG)
         cout <<  text << '\n';
 }
 
+// debug print for hot paths, unlike dbgprint() no string is built by the caller
+// enabled calls format printf style into a buffer kept per thread and print it as one line
+// format: printf format, no trailing newline
+// call it through dbglog(), which leaves out calls above DEBUG
+template <typename... Args>
+void dbglog_print(const char* format, Args... args)
+{
+    static thread_local vector <char> buffer(256);
+    int length = snprintf(buffer.data(), buffer.size(), format, args...);
+    if (length < 0)
+        return;
+    if ((size_t) length + 2 > buffer.size()) {
+        buffer.resize(length + 2);
+        snprintf(buffer.data(), buffer.size(), format, args...);
+    }
+    // a single write keeps lines from different threads apart
+    buffer[length] = '\n';
+    fwrite(buffer.data(), 1, length + 1, stdout);
+}
+
+// the level check is a constant so a call above DEBUG compiles to nothing, its arguments
+// are never evaluated
+#define dbglog(debug_level, ...) do { if ((debug_level) <= DEBUG) dbglog_print(__VA_ARGS__); } while (0)
+
 //
 //  timer
 //
@@ -214,6 +517,551 @@ double read_timer()
     return (end.tv_sec - start.tv_sec) + 1.0e-6 * (end.tv_usec - start.tv_usec);
 }
 
+// takes the calling thread's next pool_for() task
+// a thread that has used up its own range steals the back half of the next range with work left,
+// the owner keeps the front half it is about to need
+// ranges: one per thread of the team
+// self: calling thread's range
+// returns the task, -1 once every range is empty
+inline int pool_next(vector<steal_range>& ranges, int self)
+{
+    {
+        lock_guard<mutex> lock(ranges[self].lock);
+        if (ranges[self].next < ranges[self].end)
+            return ranges[self].next++;
+    }
+
+    int team = ranges.size();
+    for (int n = 1; n < team; n++) {
+        steal_range& victim = ranges[(self + n) % team];
+        int first, last;
+        {
+            lock_guard<mutex> lock(victim.lock);
+            int left = victim.end - victim.next;
+            if (left <= 0)
+                continue;
+            first = victim.end - (left + 1) / 2;
+            last = victim.end;
+            victim.end = first;
+        }
+
+        lock_guard<mutex> lock(ranges[self].lock);
+        ranges[self].next = first + 1;
+        ranges[self].end = last;
+        return first;
+    }
+
+    return -1;
+}
+
+// runs body(task) for every task in [0, count) on a team of numthreads threads
+// tasks start split in order and evenly between the threads, threads that finish early steal
+// from the others, so every thread stays busy until the last task however uneven they are
+// callers pass whole tile rows (or similar blocks) as tasks to keep neighbouring work together
+// min_tasks: below this many tasks the calling thread runs them all, waking the team is not worth it
+template <typename F>
+void pool_for(int count, F body, int min_tasks = 2)
+{
+    int team = min_n(numthreads, count);
+    if (team <= 1 || count < min_tasks) {
+        for (int task = 0; task < count; task++)
+            body(task);
+        return;
+    }
+
+    vector <steal_range> ranges(team);
+    for (int n = 0; n < team; n++) {
+        ranges[n].next = (int) ((long long) count * n / team);
+        ranges[n].end = (int) ((long long) count * (n + 1) / team);
+    }
+
+    // the team can come out smaller than asked (nested calls), stealing still covers every range
+#pragma omp parallel num_threads(team)
+    {
+        int self = omp_get_thread_num();
+        for (int task = pool_next(ranges, self); task >= 0; task = pool_next(ranges, self))
+            body(task);
+    }
+}
+
+/***********************************************/
+/*************** TRACE FUNCTIONS ***************/
+/***********************************************/
+
+#if TRACE
+// every thread that did traced work, tid is the position in this list
+vector <unique_ptr<trace_thread>> trace_threads;
+mutex trace_lock;
+thread_local trace_thread* trace_local = NULL;
+
+// work spans of one thread closer than this (seconds) are merged into one trace event
+const double TRACE_MERGE_GAP = 20e-6;
+
+// trace data of the calling thread, registered on first use
+trace_thread* trace_self()
+{
+    if (!trace_local) {
+        lock_guard<mutex> lock(trace_lock);
+        trace_threads.emplace_back(new trace_thread());
+        trace_local = trace_threads.back().get();
+        trace_local->tid = trace_threads.size() - 1;
+    }
+    return trace_local;
+}
+
+// names the calling thread in the trace viewer
+void trace_name(const char* name)
+{
+    trace_self()->name = name;
+}
+
+// names the calling thread as the ordinal-th thread of its kind, taking over the slot of an
+// earlier thread with the same name and ordinal, so threads started anew for every batch
+// do not add a row each to the trace, the earlier thread must have exited
+void trace_adopt(const char* name, int ordinal)
+{
+    if (!trace_local) {
+        lock_guard<mutex> lock(trace_lock);
+        for (size_t n = 0; n < trace_threads.size(); n++)
+            if (trace_threads[n]->ordinal == ordinal && !strcmp(trace_threads[n]->name, name)) {
+                trace_local = trace_threads[n].get();
+                break;
+            }
+    }
+    trace_name(name);
+    trace_self()->ordinal = ordinal;
+}
+
+// starts a span of work on the calling thread, spans do not nest
+void trace_begin(const char* name)
+{
+    trace_thread* self = trace_self();
+    self->open_name = name;
+    self->open_start = read_timer();
+    self->open = 1;
+}
+
+// ends the span started by trace_begin(), its time counts as busy
+void trace_end()
+{
+    trace_thread* self = trace_self();
+    double now = read_timer();
+    self->busy += now - self->open_start;
+    self->open = 0;
+
+    // a thread working through a loop would give one event per tile, keep one per run of them
+    if (!self->events.empty()) {
+        trace_event& last = self->events.back();
+        if (!last.phase && last.name == self->open_name && self->open_start - (last.start + last.dur) < TRACE_MERGE_GAP) {
+            last.dur = now - last.start;
+            last.count++;
+            return;
+        }
+    }
+
+    trace_event event;
+    event.name = self->open_name;
+    event.start = self->open_start;
+    event.dur = now - self->open_start;
+    self->events.push_back(event);
+}
+
+// the calling thread is about to block, the open span (if any) ends here so the wait
+// does not count as busy, trace_wait_end() reopens it
+void trace_wait_begin()
+{
+    trace_thread* self = trace_self();
+    self->waiting = self->open;
+    if (self->open)
+        trace_end();
+}
+
+// the wait of trace_wait_begin() is over, the span it ended goes on
+void trace_wait_end()
+{
+    trace_thread* self = trace_self();
+    if (self->waiting)
+        trace_begin(self->open_name);
+    self->waiting = 0;
+}
+
+// one candidate was taken off a tile's ranking
+inline void trace_candidate()
+{
+    trace_self()->candidates++;
+}
+
+// one repeat check compared probes earlier placements
+inline void trace_probe(int probes)
+{
+    trace_thread* self = trace_self();
+    self->checks++;
+    self->probes += probes;
+}
+
+// a tile settled on its depth-th candidate (1 is its best)
+inline void trace_pick(int depth)
+{
+    trace_thread* self = trace_self();
+    self->picks++;
+    // bucket n holds depths [2^n, 2^(n+1))
+    int bucket = 0;
+    while (bucket < 31 && (2 << bucket) <= depth)
+        bucket++;
+    self->depth[bucket]++;
+}
+
+// records a whole phase on the calling thread for as long as it is in scope
+struct trace_scope
+{
+    const char* name;
+    double start;
+
+    trace_scope(const char* phase_name) : name(phase_name), start(read_timer()) {}
+    ~trace_scope()
+    {
+        trace_event event;
+        event.name = name;
+        event.start = start;
+        event.dur = read_timer() - start;
+        event.phase = 1;
+        trace_self()->events.push_back(event);
+    }
+};
+
+// forgets everything traced so far, no traced work may be running
+void trace_reset()
+{
+    for (size_t n = 0; n < trace_threads.size(); n++) {
+        trace_thread* thread = trace_threads[n].get();
+        thread->events.clear();
+        thread->busy = 0;
+        thread->candidates = thread->checks = thread->probes = thread->picks = 0;
+        memset(thread->depth, 0, sizeof(thread->depth));
+    }
+    trace_name("main");
+}
+
+// writes everything traced since trace_reset() as a Chrome trace
+// load it in chrome://tracing or ui.perfetto.dev, the counters are under otherData
+// returns 0 for success, 1 for failure
+int trace_write()
+{
+    string file_name = FILE_TRACE;
+    if (file_name.empty()) {
+        size_t dot = FILE_OUT.rfind('.');
+        file_name = (dot == string::npos || FILE_OUT.find('/', dot) != string::npos ? FILE_OUT : FILE_OUT.substr(0, dot)) + ".trace.json";
+    }
+
+    ofstream stream(file_name.c_str());
+    if (!stream) {
+        dbgprint(0, "ERROR: Cannot write trace " + file_name);
+        return 1;
+    }
+
+    long long candidates = 0, checks = 0, probes = 0, picks = 0, depth[32] = { 0 };
+    char line[512];
+    stream << "{\"traceEvents\": [\n";
+    const char* sep = "";
+    for (size_t n = 0; n < trace_threads.size(); n++) {
+        const trace_thread& thread = *trace_threads[n];
+        candidates += thread.candidates;
+        checks += thread.checks;
+        probes += thread.probes;
+        picks += thread.picks;
+        for (int b = 0; b < 32; b++)
+            depth[b] += thread.depth[b];
+        if (thread.events.empty())
+            continue;
+
+        snprintf(line, sizeof(line), "%s{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": %d, \"args\": {\"name\": \"%s %d\"}}",
+                 sep, thread.tid, thread.name, thread.tid);
+        stream << line;
+        sep = ",\n";
+        for (size_t e = 0; e < thread.events.size(); e++) {
+            const trace_event& event = thread.events[e];
+            snprintf(line, sizeof(line), "%s{\"name\": \"%s\", \"cat\": \"%s\", \"ph\": \"X\", \"pid\": 1, \"tid\": %d, "
+                     "\"ts\": %.1f, \"dur\": %.1f, \"args\": {\"spans\": %d}}",
+                     sep, event.name, event.phase ? "phase" : "work", thread.tid, event.start * 1e6, event.dur * 1e6, event.count);
+            stream << line;
+        }
+    }
+    stream << "\n],\n\"otherData\": {\n";
+
+    snprintf(line, sizeof(line), "  \"tiles\": %d, \"candidates\": %lld, \"candidates_per_tile\": %.2f, "
+             "\"repeat_checks\": %lld, \"repeat_probes\": %lld, \"picks\": %lld,\n",
+             TOTAL_TILES, candidates, TOTAL_TILES ? (double) candidates / TOTAL_TILES : 0.0, checks, probes, picks);
+    stream << line;
+
+    // histogram of the rank each pick settled on, keyed by the lowest depth of the bucket
+    stream << "  \"pick_depth\": {";
+    sep = "";
+    for (int b = 0; b < 32; b++)
+        if (depth[b]) {
+            snprintf(line, sizeof(line), "%s\"%lld\": %lld", sep, 1LL << b, depth[b]);
+            stream << line;
+            sep = ", ";
+        }
+    stream << "},\n";
+
+    // idle time of a thread in a phase is the phase's wall time minus its busy time
+    stream << "  \"phases\": [";
+    sep = "";
+    for (size_t n = 0; n < trace_threads.size(); n++)
+        for (size_t p = 0; p < trace_threads[n]->events.size(); p++) {
+            const trace_event& phase = trace_threads[n]->events[p];
+            if (!phase.phase)
+                continue;
+
+            snprintf(line, sizeof(line), "%s\n    {\"name\": \"%s\", \"wall_s\": %.6f, \"busy_s\": {", sep, phase.name, phase.dur);
+            stream << line;
+            sep = ",";
+            const char* busy_sep = "";
+            for (size_t t = 0; t < trace_threads.size(); t++) {
+                double busy = 0;
+                const vector <trace_event>& events = trace_threads[t]->events;
+                for (size_t e = 0; e < events.size(); e++)
+                    if (!events[e].phase)
+                        busy += max(0.0, min(events[e].start + events[e].dur, phase.start + phase.dur) - max(events[e].start, phase.start));
+                if (busy > 0) {
+                    snprintf(line, sizeof(line), "%s\"%d\": %.6f", busy_sep, trace_threads[t]->tid, busy);
+                    stream << line;
+                    busy_sep = ", ";
+                }
+            }
+            stream << "}}";
+        }
+    stream << "\n  ]\n}}\n";
+
+    if (!stream) {
+        dbgprint(0, "ERROR: Cannot write trace " + file_name);
+        return 1;
+    }
+    dbgprint(1, "Wrote trace " + file_name);
+    return 0;
+}
+#else
+// tracing is compiled out, every call below is empty
+inline void trace_name(const char*) {}
+inline void trace_adopt(const char*, int) {}
+inline void trace_begin(const char*) {}
+inline void trace_end() {}
+inline void trace_wait_begin() {}
+inline void trace_wait_end() {}
+inline void trace_candidate() {}
+inline void trace_probe(int) {}
+inline void trace_pick(int) {}
+struct trace_scope { trace_scope(const char*) {} };
+inline void trace_reset() {}
+inline int trace_write() { return 0; }
+#endif
+
+
+/***********************************************/
+/*************** TILE CACHE FUNCTIONS **********/
+/***********************************************/
+
+// sets up an empty arena for the current component crop size
+// must be called after get_mosaic_metadata() has chosen cmp_width and cmp_height
+// an arena that already holds this crop of these components is kept (batch jobs share it)
+void tile_cache_init()
+{
+    size_t stride = (size_t) mosaic.cmp_width * mosaic.cmp_height * 3;
+    if (stride == tile_cache_stride && tile_cache_loaded.size() == (size_t) components_size)
+        return;
+
+    tile_cache_stride = stride;
+    tile_cache.assign(tile_cache_stride * components_size, 0);
+    tile_cache_loaded = vector<atomic<char>>(components_size);
+}
+
+// cached pixels of a component image
+// img_index: component image
+// returns pointer to the first (top) row, rows are cmp_width * 3 bytes apart
+inline unsigned char* tile_cache_get(int img_index)
+{
+    return &tile_cache[tile_cache_stride * img_index];
+}
+
+// copies the crop of a decoded component into the arena and wakes anyone waiting on it
+// img_index: component image
+// image: the decoded file
+// returns 0 for success, 1 for failure
+int tile_cache_store(int img_index, bitmap_image& image)
+{
+    int failed = 0;
+    if (!image || image.width() < mosaic.cmp_width || image.height() < mosaic.cmp_height) {
+        dbgprint(0, "ERROR: Cannot cache component " + components[img_index].path);
+        failed = 1;
+    } else {
+        // crop the top left corner, same region write_full_img() used to take
+        size_t row_bytes = (size_t) mosaic.cmp_width * 3;
+        unsigned char* dst = tile_cache_get(img_index);
+        for (size_t y = 0; y < mosaic.cmp_height; y++)
+            memcpy(dst + y * row_bytes, image.row(y), row_bytes);
+    }
+
+    // a component that failed to load stays black, waiters must still be released
+    {
+        lock_guard<mutex> lock(tile_cache_lock);
+        tile_cache_loaded[img_index].store(1, memory_order_release);
+    }
+    tile_cache_ready.notify_all();
+    return failed;
+}
+
+// decodes a component image once and copies its crop into the arena
+// img_index: component image to load
+// returns 0 for success, 1 for failure
+int tile_cache_load(int img_index)
+{
+    if (tile_cache_loaded[img_index].load(memory_order_acquire))
+        return 0;
+
+    // mapped, only the pages under the crop are ever read
+    bitmap_image image(components[img_index].path, bitmap_image::mapped_mode);
+    return tile_cache_store(img_index, image);
+}
+
+// blocks until a component queued with tile_loader_start() is in the arena
+inline void tile_cache_wait(int img_index)
+{
+    if (tile_cache_loaded[img_index].load(memory_order_acquire))
+        return;
+
+    trace_wait_begin();
+    unique_lock<mutex> lock(tile_cache_lock);
+    tile_cache_ready.wait(lock, [img_index] { return tile_cache_loaded[img_index].load(memory_order_acquire) != 0; });
+    trace_wait_end();
+}
+
+// body of a loader thread, reads the next image of tile_loader_order until none are left
+// reader: ordinal of the thread in its tile_loader_start() batch
+void tile_loader_run(int reader)
+{
+    trace_adopt("loader", reader);
+    for (int n = tile_loader_next++; n < (int) tile_loader_order.size(); n = tile_loader_next++) {
+        int img_index = tile_loader_order[n];
+        trace_begin("read");
+        if (tile_loader_queue) {
+            // the worker popping it does the crop, so the readers go straight back to the disk
+            decoded_component item;
+            item.img_index = img_index;
+            // mapping is cheap, the readahead hint starts paging in the crop before the worker gets to it
+            item.image.reset(new bitmap_image(components[img_index].path, bitmap_image::mapped_mode));
+            item.image->advise_rows(0, min_n(mosaic.cmp_height, item.image->height()));
+            tile_loader_queue->push(move(item));
+        } else {
+            tile_cache_load(img_index);
+        }
+        trace_end();
+    }
+
+    // the last reader out tells the workers nothing else is coming
+    if (--tile_loader_active == 0 && tile_loader_queue)
+        tile_loader_queue->close();
+}
+
+// starts reading components in the background, in the order given
+// order: components to load, each at most once
+// queue: receives the decoded images, NULL to crop them into the arena right away
+//        (wait on those with tile_cache_wait())
+// every call must be paired with tile_loader_join()
+void tile_loader_start(const vector<int>& order, bounded_queue<decoded_component>* queue)
+{
+    tile_loader_order = order;
+    tile_loader_queue = queue;
+    tile_loader_next = 0;
+
+    int readers = min_n(max_n(IO_THREADS, 1), (int) order.size());
+    tile_loader_active = readers;
+    if (readers == 0 && queue)
+        queue->close();
+
+    for (int n = 0; n < readers; n++)
+        tile_loader_threads.emplace_back(tile_loader_run, n);
+}
+
+// waits for the readers started by tile_loader_start() to finish
+void tile_loader_join()
+{
+    for (size_t n = 0; n < tile_loader_threads.size(); n++)
+        tile_loader_threads[n].join();
+    tile_loader_threads.clear();
+    tile_loader_queue = NULL;
+}
+
+// starts loading every placed component that is not in the cache yet
+// components are queued in the order the writer first needs them, so compositing
+// can start on the first tiles while later ones are still being read
+// bottom_up: 1 to follow the file order of a BMP (last tile row first)
+// must be paired with tile_loader_join()
+void tile_cache_prefetch_placed(int bottom_up = 0)
+{
+    vector <int> pending;
+    vector <char> queued(components_size, 0);
+    for (int row = 0; row < mosaic.rows; row++) {
+        int tile_row = bottom_up ? mosaic.rows - 1 - row : row;
+        for (int col = 0; col < mosaic.cols; col++) {
+            int img_index = tile_img[tile_row * mosaic.cols + col];
+            if (img_index < 0 || queued[img_index] || tile_cache_loaded[img_index].load(memory_order_acquire))
+                continue;
+            queued[img_index] = 1;
+            pending.push_back(img_index);
+        }
+    }
+
+    tile_loader_start(pending, NULL);
+}
+
+// makes sure every placed component is in the cache
+// each image is decoded at most once no matter how often it was placed
+void tile_cache_load_placed()
+{
+    tile_cache_prefetch_placed();
+    tile_loader_join();
+}
+
+// builds preview levels 1 to levels of every placed component with bitmap_image::subsample()
+// each level is made from the one above it, so every pixel of the cache is read once
+void tile_pyramid_build(int levels)
+{
+    tile_cache_load_placed();
+
+    vector <int> placed;
+    vector <char> queued(components_size, 0);
+    for (int tile_index = 0; tile_index < TOTAL_TILES; tile_index++) {
+        int img_index = tile_img[tile_index];
+        if (img_index >= 0 && !queued[img_index]) {
+            queued[img_index] = 1;
+            placed.push_back(img_index);
+        }
+    }
+
+    tile_pyramid.resize(levels + 1);
+    for (int level = 1; level <= levels; level++) {
+        unsigned int w = level == 1 ? mosaic.cmp_width : tile_pyramid[level - 1].width;
+        unsigned int h = level == 1 ? mosaic.cmp_height : tile_pyramid[level - 1].height;
+        size_t src_stride = level == 1 ? tile_cache_stride : tile_pyramid[level - 1].stride;
+        const unsigned char* src_pixels = level == 1 ? tile_cache.data() : tile_pyramid[level - 1].pixels.data();
+
+        // subsample() rounds odd sizes up
+        tile_level& dst = tile_pyramid[level];
+        dst.width = (w + 1) / 2;
+        dst.height = (h + 1) / 2;
+        dst.stride = (size_t) dst.width * dst.height * 3;
+        dst.pixels.assign(dst.stride * components_size, 0);
+
+        pool_for((int) placed.size(), [&](int n) {
+            // both images borrow their slot, subsample() writes straight into the pyramid
+            bitmap_image full(const_cast<unsigned char*>(src_pixels + src_stride * placed[n]), w, h);
+            bitmap_image half(&dst.pixels[dst.stride * placed[n]], dst.width, dst.height);
+            full.subsample(half);
+        });
+    }
+}
+
+
 /***********************************************/
 /*************** FILE OUTPUT FUNCTIONS *********/
 /***********************************************/
@@ -241,9 +1089,9 @@ int write_bmp_template()
 		for (size_t x = 0; x < mosaic.width; x++)
 		{
 			// write the weight to this tile (just for debugging)
-			for(int n = 0; n < components_size; n++)
-				if ((x >= tiles[n].start_x && y >= tiles[n].start_y) && (x <= tiles[n].end_x && y <= tiles[n].end_y))
-					image.set_pixel(x, y, tiles[n].rgb);
+			for(int n = 0; n < TOTAL_TILES; n++)
+				if ((x >= tile_x(n) && y >= tile_y(n)) && (x < tile_x(n) + mosaic.cmp_width && y < tile_y(n) + mosaic.cmp_height))
+					image.set_pixel(x, y, tile_rgb[n]);
 			if (x == 0)
 				printf("XY %d %d\n", x, y);
 		}
@@ -262,167 +1110,1422 @@ int write_bmp_template()
 // VERY VERY VERY slow due to constantly loading the entire final_img (which can be huge)
 int write_component_img(int tile_index)
 {
-    mosaic_tile cur_tile = tiles[tile_index];
     bitmap_image final_img(FILE_OUT);
-    bitmap_image tile_img(components[cur_tile.img_index].path);
-    bitmap_image buffer;
-    string output = "Placing tile " + to_string(tile_index);
-    dbgprint(2, output);
+    dbglog(2, "Placing tile %d", tile_index);
 
     // write only the region specified by tile_index
-    tile_img.region(0, 0, mosaic.cmp_width, mosaic.cmp_height, buffer);
-    final_img.copy_from(buffer, cur_tile.start_x, cur_tile.start_y);
+    tile_cache_load(tile_img[tile_index]);
+    const unsigned char* src = tile_cache_get(tile_img[tile_index]);
+    size_t row_bytes = (size_t) mosaic.cmp_width * 3;
+    for (size_t y = 0; y < mosaic.cmp_height; y++)
+        memcpy(final_img.row(tile_y(tile_index) + y) + tile_x(tile_index) * 3, src + y * row_bytes, row_bytes);
 
     final_img.save_image(FILE_OUT);
 
     return 0;
 }
 
-// writes the full image to a file
-// very fast due to only loading the final_img once
-int write_full_img()
+// blends one scanline towards a tile color, the tint is fused into the copy
+// dst[i] = (src[i] * keep[i] + add[i]) >> 8, keep[i] is 256 and add[i] 0 for untouched channels
+// every argument is a whole BGR scanline so the loop vectorizes without a per pixel branch
+inline void tint_scanline(const unsigned char* __restrict src, unsigned char* __restrict dst,
+                          const unsigned short* __restrict keep, const unsigned short* __restrict add, size_t bytes)
 {
-    bitmap_image final_img(FILE_OUT);
-    // write all the regions one by one
-#pragma omp parallel for num_threads(numthreads)
-    for (int tile_index = 0; tile_index < TOTAL_TILES; tile_index++) {
-        mosaic_tile cur_tile = tiles[tile_index];
-        bitmap_image tile_img(components[cur_tile.img_index].path);
-        bitmap_image buffer;
+#pragma omp simd
+    for (size_t i = 0; i < bytes; i++)
+        dst[i] = (unsigned char) ((src[i] * keep[i] + add[i]) >> 8);
+}
 
-        string output = "Placing tile " + to_string(tile_index);
-        dbgprint(2, output);
+// tints a whole tile towards a color
+// src: tile pixels, rows are width * 3 bytes apart
+// dst: first pixel of the top scanline in the destination
+// dst_stride: bytes from one destination scanline to the next
+// channel: BGR offset of the channel to blend, value: color to blend it towards
+void tint_tile(const unsigned char* src, unsigned int width, unsigned int height,
+               unsigned char* dst, ptrdiff_t dst_stride, int channel, unsigned char value)
+{
+    size_t row_bytes = (size_t) width * 3;
+
+    // v + FILTER_PERCENT * (t - v) == (v * (256 - f) + t * f) / 256 in 8.8 fixed point
+    // the shift truncates like the old float to unsigned char did, only f being rounded to
+    // 1/256 steps moves a channel, by at most 1 either way
+    unsigned short f = (unsigned short) (FILTER_PERCENT * 256.0f + 0.5f);
+    static thread_local vector <unsigned short> keep, add;
+    keep.assign(row_bytes, 256);
+    add.assign(row_bytes, 0);
+    for (size_t i = channel; i < row_bytes; i += 3) {
+        keep[i] = 256 - f;
+        add[i] = (unsigned short) (value * f);
+    }
 
-        if (FILTER) {
-            for (size_t y = 0; y < mosaic.cmp_height; y++)
-            {
-                for (size_t x = 0; x < mosaic.cmp_width; x++)
-                {
-                    rgb_t rgb;
-                    tile_img.get_pixel(x, y, rgb);
-
-                    // avg the colors to add a color filter (better matches original super pixel
-                    if (cur_tile.rgb.red > cur_tile.rgb.green && cur_tile.rgb.red > cur_tile.rgb.blue)
-                        rgb.red += FILTER_PERCENT * (float)(cur_tile.rgb.red - rgb.red);
-                    else if (cur_tile.rgb.green > cur_tile.rgb.red && cur_tile.rgb.green > cur_tile.rgb.blue)
-                        rgb.green += FILTER_PERCENT * (float)(cur_tile.rgb.green - rgb.green);
-                    else if (cur_tile.rgb.blue > cur_tile.rgb.red && cur_tile.rgb.blue > cur_tile.rgb.green)
-                        rgb.blue += FILTER_PERCENT * (float) (cur_tile.rgb.blue - rgb.blue);
-
-                    tile_img.set_pixel(x, y, rgb);
-                }
-            }
-        }
+    for (size_t y = 0; y < height; y++)
+        tint_scanline(src + y * row_bytes, dst + (ptrdiff_t) y * dst_stride, keep.data(), add.data(), row_bytes);
+}
 
-        tile_img.region(0, 0, mosaic.cmp_width, mosaic.cmp_height, buffer);
-        final_img.copy_from(buffer, cur_tile.start_x, cur_tile.start_y);
+// key of a tinted tile: component, pyramid level, blended channel and its value
+inline unsigned long long tint_cache_key(int img_index, int level, int channel, unsigned char value)
+{
+    return ((unsigned long long) img_index << 24) | (level << 16) | (channel << 8) | value;
+}
 
+// looks up a tinted tile, tinting and caching it on a miss
+// returns width * height * 3 bytes of tinted pixels, keep the pointer for as long as the pixels are read
+shared_ptr<const vector<unsigned char>> tint_cache_get(const unsigned char* src, unsigned int width, unsigned int height,
+                                                      int img_index, int level, int channel, unsigned char value)
+{
+    unsigned long long key = tint_cache_key(img_index, level, channel, value);
+    {
+        lock_guard <mutex> guard(tint_cache_lock);
+        auto found = tint_cache_map.find(key);
+        if (found != tint_cache_map.end()) {
+            tint_cache_lru.splice(tint_cache_lru.begin(), tint_cache_lru, found->second);
+            tint_cache_hits++;
+            return found->second->second;
+        }
+        tint_cache_misses++;
     }
 
-    final_img.save_image(FILE_OUT);
+    // tint outside the lock, two threads racing on one key just both fill it
+    shared_ptr <vector<unsigned char>> pixels = make_shared <vector<unsigned char>>((size_t) width * height * 3);
+    tint_tile(src, width, height, pixels->data(), (ptrdiff_t) width * 3, channel, value);
+
+    lock_guard <mutex> guard(tint_cache_lock);
+    if (tint_cache_map.find(key) == tint_cache_map.end()) {
+        tint_cache_lru.emplace_front(key, pixels);
+        tint_cache_map[key] = tint_cache_lru.begin();
+        tint_cache_bytes += pixels->size();
+
+        // drop the least recently used tiles until we are back under budget
+        size_t budget = (size_t) TINT_CACHE_MB << 20;
+        while (tint_cache_bytes > budget && !tint_cache_lru.empty()) {
+            tint_cache_bytes -= tint_cache_lru.back().second->size();
+            tint_cache_map.erase(tint_cache_lru.back().first);
+            tint_cache_lru.pop_back();
+        }
+    }
+    return pixels;
+}
 
-    return 0;
+// prints how well the tinted tile cache did and empties it
+void tint_cache_report()
+{
+    if (TINT_CACHE_MB <= 0)
+        return;
+
+    long long lookups = tint_cache_hits + tint_cache_misses;
+    string output = "Tint cache: " + to_string(tint_cache_hits) + " hits, " + to_string(tint_cache_misses) + " misses";
+    if (lookups)
+        output += " (" + to_string(100 * tint_cache_hits / lookups) + "% hit rate)";
+    output += ", " + to_string(tint_cache_bytes >> 20) + " MB held";
+    dbgprint(1, output);
+
+    tint_cache_lru.clear();
+    tint_cache_map.clear();
+    tint_cache_bytes = 0;
+    tint_cache_hits = tint_cache_misses = 0;
 }
 
+// avg the colors to add a color filter (better matches original super pixel)
+// only the channel that dominates the tile is blended, decided once per tile
+// value: receives the color to blend towards, rounded to TINT_CACHE_QUANT while the tinted tile cache is on
+// returns BGR offset of that channel, -1 when FILTER is off or no channel dominates
+int tile_filter_channel(int tile_index, unsigned char* value)
+{
+    const rgb_t& target = tile_rgb[tile_index];
+    int channel = -1;
+    *value = 0;
+    if (FILTER) {
+        if (target.red > target.green && target.red > target.blue)
+            channel = 2, *value = target.red;
+        else if (target.green > target.red && target.green > target.blue)
+            channel = 1, *value = target.green;
+        else if (target.blue > target.red && target.blue > target.green)
+            channel = 0, *value = target.blue;
+    }
 
-/*********************************************/
-/*************** FIT FUNCTIONS ***************/
-/*********************************************/
+    // similar tints share one cached tile
+    if (channel >= 0 && TINT_CACHE_MB > 0) {
+        int quant = max_n(TINT_CACHE_QUANT, 1);
+        *value = (unsigned char) min_n((*value + quant / 2) / quant * quant, 255);
+    }
+    return channel;
+}
 
-// chooses the best available image, allows repeats without care
-// tile_index: current tile to map an image to
-// returns best fitting image
-int fit_best_pick(unsigned int tile_index)
+// copies a placed tile (with the color filter applied) out of the tile cache
+// tile_index: tile to draw
+// dst: first pixel of the tile's top scanline in the destination
+// dst_stride: bytes from one destination scanline to the next (negative for bottom-up buffers)
+// level: 0 for full size tiles, n for the 1/2^n size preview tiles
+void tile_blit(int tile_index, unsigned char* dst, ptrdiff_t dst_stride, int level = 0)
 {
-    int n = 0;
-    int img_index = tile_map[tile_index][n].index;
+    int img_index = tile_img[tile_index];
+    unsigned int tile_width = level ? tile_pyramid[level].width : mosaic.cmp_width;
+    unsigned int tile_height = level ? tile_pyramid[level].height : mosaic.cmp_height;
+    size_t row_bytes = (size_t) tile_width * 3;
+    if (!level)
+        tile_cache_wait(img_index);
+    const unsigned char* src = level ? &tile_pyramid[level].pixels[tile_pyramid[level].stride * img_index]
+                                     : tile_cache_get(img_index);
+
+    unsigned char value = 0;
+    int channel = tile_filter_channel(tile_index, &value);
+
+    // holds the tinted tile until the blit is done, the cache may drop it any time before that
+    shared_ptr <const vector<unsigned char>> tinted;
+    if (channel >= 0 && TINT_CACHE_MB > 0) {
+        // similar tints share one cached tile, the tinted copy is a plain memcpy blit
+        tinted = tint_cache_get(src, tile_width, tile_height, img_index, level, channel, value);
+        src = tinted->data();
+        channel = -1;
+    }
 
-    // choose first best pick that isnt repeated as much
-    while (n < components_size && components[img_index].placed >= TILE_RPT_COUNT) {
-        img_index = tile_map[tile_index][n].index;
-        n++;
+    if (channel < 0) {
+        for (size_t y = 0; y < tile_height; y++)
+            memcpy(dst + (ptrdiff_t) y * dst_stride, src + y * row_bytes, row_bytes);
+        return;
     }
 
-    return img_index;
+    tint_tile(src, tile_width, tile_height, dst, dst_stride, channel, value);
 }
 
-// checks around if we've used the tile before
+// writes the full image to a file
+// very fast due to only loading the final_img once
+int write_full_img()
+{
+    // components that were not weighed from the cache are read while the template loads
+    tile_cache_prefetch_placed();
+    bitmap_image final_img(FILE_OUT);
+
+    // write all the regions one tile row at a time
+    pool_for(mosaic.rows, [&](int row) {
+        trace_begin("write");
+        for (int tile_index = row * mosaic.cols; tile_index < (row + 1) * mosaic.cols; tile_index++) {
+            dbglog(2, "Placing tile %d", tile_index);
+
+            tile_blit(tile_index, final_img.row(tile_y(tile_index)) + tile_x(tile_index) * 3, (ptrdiff_t) mosaic.width * 3);
+        }
+        trace_end();
+    });
+    tile_loader_join();
+
+    final_img.save_image(FILE_OUT);
+
+    return 0;
+}
+
+#if GPU_OFFLOAD
+// composites the full size tile rows of write_stream_img() on the device, GPU_BAND_ROWS at a time
+// the tile cache and every tile's component and filter go over once, each band is drawn straight
+// into a device canvas in BMP file layout and copied back to be written while nothing else is held
+// stream: file the header was already written to
+// line_bytes: padded BMP scanline size
+// rows: tile rows to write, the shard's band
+// returns 0 for success, 1 for failure
+int write_stream_gpu(ostream& stream, size_t line_bytes, int rows)
+{
+    // the canvas is drawn in one go, so every placed component has to be in the arena first
+    tile_loader_join();
+    dbgprint(1, omp_get_num_devices() > 0 ? "Compositing on device " + to_string(omp_get_default_device())
+                                          : "No offload device, compositing kernel runs on the host");
+
+    int cols = mosaic.cols;
+    int count = rows * cols;
+    size_t tile_height = mosaic.cmp_height;
+    size_t tile_bytes = (size_t) mosaic.cmp_width * 3;
+    size_t row_bytes = tile_bytes * cols;
+    size_t stride = tile_cache_stride;
+
+    // filter of every tile, decided on the host the same way tile_blit() does
+    vector <int> imgs(tile_img.begin() + (size_t) shard_row_begin * cols, tile_img.begin() + (size_t) shard_row_end * cols);
+    vector <signed char> channels(count);
+    vector <unsigned char> values(count);
+    for (int t = 0; t < count; t++)
+        channels[t] = (signed char) tile_filter_channel(shard_row_begin * cols + t, &values[t]);
+    // v + FILTER_PERCENT * (t - v) in 8.8 fixed point, see tint_tile()
+    int f = (int) (FILTER_PERCENT * 256.0f + 0.5f);
+
+    int band_rows = min_n(max_n(GPU_BAND_ROWS, 1), rows);
+    vector <unsigned char> band(line_bytes * tile_height * band_rows);
+
+    const unsigned char* arena = tile_cache.data();
+    size_t arena_bytes = tile_cache.size();
+    const int* img = imgs.data();
+    const signed char* chan = channels.data();
+    const unsigned char* val = values.data();
+    unsigned char* out = band.data();
+    size_t band_bytes = band.size();
+
+#pragma omp target data map(to: arena[0:arena_bytes], img[0:count], chan[0:count], val[0:count]) map(alloc: out[0:band_bytes])
+    {
+        // bands go in file order, the last tile row first
+        for (int first = 0; first < rows; first += band_rows) {
+            size_t lines = (size_t) min_n(band_rows, rows - first) * tile_height;
+
+            trace_begin("write");
+#pragma omp target teams distribute parallel for collapse(2)
+            for (size_t line = 0; line < lines; line++) {
+                for (size_t x = 0; x < line_bytes; x++) {
+                    // strips are in file order too, a tile's top scanline is the strip's last line
+                    int n = first + (int) (line / tile_height);
+                    size_t y = tile_height - 1 - line % tile_height;
+                    // padding bytes stay zero
+                    unsigned char v = 0;
+                    int t = (rows - 1 - n) * cols + (int) (x / tile_bytes);
+                    if (x < row_bytes && img[t] >= 0) {
+                        size_t i = x % tile_bytes;
+                        v = arena[stride * img[t] + y * tile_bytes + i];
+                        if (chan[t] == (int) (i % 3))
+                            v = (unsigned char) ((v * (256 - f) + val[t] * f) >> 8);
+                    }
+                    out[line * line_bytes + x] = v;
+                }
+            }
+#pragma omp target update from(out[0:lines * line_bytes])
+            trace_end();
+
+            stream.write((const char*) out, lines * line_bytes);
+        }
+    }
+    return stream ? 0 : 1;
+}
+#endif
+
+// streams the mosaic to a file one tile row at a time
+// every thread composites whole tile rows into a strip of its own (cmp_height scanlines in file
+// layout), so tiles land in contiguous memory no other thread writes to, and strips are written
+// in file order as soon as the ones before them are out
+// no template is needed and only one strip per thread is ever in memory
+// file_name: file to write
+// level: 0 for the full mosaic, n for a preview built from tile_pyramid[n]
+// returns 0 for success, 1 for failure
+int write_stream_img(const string& file_name = FILE_OUT, int level = 0)
+{
+    ofstream stream(file_name.c_str(), ios::binary);
+    if (!stream) {
+        dbgprint(0, "ERROR: Cannot open " + file_name + " for writing");
+        return 1;
+    }
+
+    // components that were not weighed from the cache are read in file order,
+    // each band only waits for its own tiles (previews come from the pyramid, which is complete)
+    if (!level)
+        tile_cache_prefetch_placed(1);
+
+    unsigned int tile_width = level ? tile_pyramid[level].width : mosaic.cmp_width;
+    unsigned int tile_height = level ? tile_pyramid[level].height : mosaic.cmp_height;
+    // a shard only writes its own band, top to bottom the same as the full mosaic
+    int rows = shard_row_end - shard_row_begin;
+    unsigned int width = tile_width * mosaic.cols;
+    unsigned int height = tile_height * rows;
+    bitmap_image().save_header(stream, width, height);
+
+    // BMP scanlines are padded to 4 bytes and stored bottom row first
+    size_t line_bytes = ((size_t) width * 3 + 3) & ~(size_t) 3;
+
+#if GPU_OFFLOAD
+    // previews are small and come from the pyramid, only the full size write is offloaded
+    if (!level) {
+        int failed = write_stream_gpu(stream, line_bytes, rows);
+        stream.close();
+        return failed || !stream ? 1 : 0;
+    }
+#endif
+
+    // strips are handed out in file order instead of through pool_for(), a thread holding a late
+    // strip only ever waits on strips that are already being composited
+    atomic<int> next_strip(0);
+    int written = 0;
+    mutex write_lock;
+    condition_variable write_turn;
+
+#pragma omp parallel num_threads(min_n(numthreads, rows))
+    {
+        // padding bytes are never drawn over and stay zero
+        vector <unsigned char> strip(line_bytes * tile_height, 0);
+        unsigned char* strip_top = &strip[line_bytes * (tile_height - 1)];
+
+        // the last tile row is the first one in the file
+        for (int n = next_strip++; n < rows; n = next_strip++) {
+            int row = shard_row_end - 1 - n;
+
+            // strip is kept in file order, so the tile's top scanline is the strip's last line
+            trace_begin("write");
+            for (int col = 0; col < mosaic.cols; col++) {
+                dbglog(2, "Placing tile %d", row * mosaic.cols + col);
+                tile_blit(row * mosaic.cols + col, strip_top + (size_t) col * tile_width * 3, -(ptrdiff_t) line_bytes, level);
+            }
+            trace_end();
+
+            unique_lock<mutex> lock(write_lock);
+            write_turn.wait(lock, [&]() { return written == n; });
+            stream.write((const char*) strip.data(), strip.size());
+            written++;
+            write_turn.notify_all();
+        }
+    }
+    if (!level)
+        tile_loader_join();
+
+    stream.close();
+    return stream ? 0 : 1;
+}
+
+// 1 when file_name should be written as a PNG (ends in .png, any case)
+int png_file_name(const string& file_name)
+{
+    if (file_name.size() < 4)
+        return 0;
+    string ext = file_name.substr(file_name.size() - 4);
+    for (size_t n = 0; n < ext.size(); n++)
+        ext[n] = (char) tolower((unsigned char) ext[n]);
+    return ext == ".png";
+}
+
+#if PNG_OUTPUT
+// PNG Paeth predictor of a byte from its left (a), upper (b) and upper left (c) neighbours
+inline int png_paeth(int a, int b, int c)
+{
+    int p = a + b - c;
+    int pa = abs(p - a), pb = abs(p - b), pc = abs(p - c);
+    if (pa <= pb && pa <= pc)
+        return a;
+    return pb <= pc ? b : c;
+}
+
+// appends a 32 bit value in PNG (big endian) byte order
+inline void png_put_u32(unsigned char* out, unsigned long value)
+{
+    out[0] = (unsigned char) (value >> 24);
+    out[1] = (unsigned char) (value >> 16);
+    out[2] = (unsigned char) (value >> 8);
+    out[3] = (unsigned char) value;
+}
+
+// writes one whole PNG chunk, the crc covers the type and the data
+void png_write_chunk(ostream& stream, const char* type, const unsigned char* data, size_t bytes)
+{
+    unsigned char head[8], tail[4];
+    png_put_u32(head, bytes);
+    memcpy(head + 4, type, 4);
+    // crc32() restarts on a NULL buffer, so empty chunks only hash their type
+    uLong crc = crc32(0L, head + 4, 4);
+    if (bytes)
+        crc = crc32(crc, data, bytes);
+    png_put_u32(tail, crc);
+    stream.write((const char*) head, sizeof(head));
+    stream.write((const char*) data, bytes);
+    stream.write((const char*) tail, sizeof(tail));
+}
+
+// writes the mosaic as a PNG, one tile row strip at a time like write_stream_img()
+// every thread composites, filters and deflates whole strips on its own, each strip ends on a
+// byte aligned sync flush so the raw deflate streams join into one zlib stream the way pigz does
+// the writing thread only copies finished IDAT chunks and combines the strips' adler32 sums
+// file_name: file to write
+// level: 0 for the full mosaic, n for a preview built from tile_pyramid[n]
+// returns 0 for success, 1 for failure
+int write_png_img(const string& file_name = FILE_OUT, int level = 0)
+{
+    ofstream stream(file_name.c_str(), ios::binary);
+    if (!stream) {
+        dbgprint(0, "ERROR: Cannot open " + file_name + " for writing");
+        return 1;
+    }
+
+    // PNG scanlines go top row first, so components are prefetched in that order
+    if (!level)
+        tile_cache_prefetch_placed(0);
+
+    unsigned int tile_width = level ? tile_pyramid[level].width : mosaic.cmp_width;
+    unsigned int tile_height = level ? tile_pyramid[level].height : mosaic.cmp_height;
+    int rows = shard_row_end - shard_row_begin;
+    unsigned int width = tile_width * mosaic.cols;
+    unsigned int height = tile_height * rows;
+    size_t line_bytes = (size_t) width * 3;
+
+    // 8 bit RGB, no interlacing
+    const unsigned char signature[8] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n' };
+    unsigned char ihdr[13] = { 0 };
+    png_put_u32(ihdr, width);
+    png_put_u32(ihdr + 4, height);
+    ihdr[8] = 8;
+    ihdr[9] = 2;
+    stream.write((const char*) signature, sizeof(signature));
+    png_write_chunk(stream, "IHDR", ihdr, sizeof(ihdr));
+    // zlib header (deflate, 32K window), the strips' deflate data follows in their own chunks
+    const unsigned char zlib_header[2] = { 0x78, 0x01 };
+    png_write_chunk(stream, "IDAT", zlib_header, sizeof(zlib_header));
+
+    atomic<int> next_strip(0);
+    // set by any thread whose deflate fails
+    atomic<int> failed(0);
+    int written = 0;
+    uLong adler = adler32(0L, Z_NULL, 0);
+    mutex write_lock;
+    condition_variable write_turn;
+
+#pragma omp parallel num_threads(min_n(numthreads, rows))
+    {
+        vector <unsigned char> strip(line_bytes * tile_height);
+        // every scanline gets a filter type byte in front
+        vector <unsigned char> filtered((line_bytes + 1) * tile_height);
+        vector <unsigned char> chunk;
+        z_stream z;
+        memset(&z, 0, sizeof(z));
+        bool ready = deflateInit2(&z, PNG_LEVEL, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) == Z_OK;
+        if (!ready)
+            failed = 1;
+        // strips go out in order, so a failed strip still passes its turn on to the next one
+        auto take_turn = [&](int n, uLong strip_adler) {
+            unique_lock<mutex> lock(write_lock);
+            write_turn.wait(lock, [&]() { return written == n; });
+            if (!failed) {
+                stream.write((const char*) chunk.data(), chunk.size());
+                adler = adler32_combine(adler, strip_adler, filtered.size());
+            }
+            written++;
+            write_turn.notify_all();
+        };
+
+        for (int n = next_strip++; n < rows; n = next_strip++) {
+            int row = shard_row_begin + n;
+            if (failed) {
+                take_turn(n, 0);
+                continue;
+            }
+
+            trace_begin("write");
+            for (int col = 0; col < mosaic.cols; col++) {
+                dbglog(2, "Placing tile %d", row * mosaic.cols + col);
+                tile_blit(row * mosaic.cols + col, &strip[(size_t) col * tile_width * 3], (ptrdiff_t) line_bytes, level);
+            }
+
+            // PNG pixels are RGB, tile_blit() draws BGR
+            for (size_t i = 0; i < strip.size(); i += 3)
+                swap(strip[i], strip[i + 2]);
+
+            // Paeth on every scanline but the first of a strip, which uses Sub so strips never
+            // depend on each other (Paeth with a zero line above comes down to Sub)
+            for (unsigned int y = 0; y < tile_height; y++) {
+                const unsigned char* cur = &strip[y * line_bytes];
+                const unsigned char* up = y ? cur - line_bytes : NULL;
+                unsigned char* out = &filtered[y * (line_bytes + 1)];
+                *out++ = y ? 4 : 1;
+                for (size_t i = 0; i < line_bytes; i++) {
+                    int a = i >= 3 ? cur[i - 3] : 0;
+                    int b = up ? up[i] : 0;
+                    int c = up && i >= 3 ? up[i - 3] : 0;
+                    out[i] = (unsigned char) (cur[i] - png_paeth(a, b, c));
+                }
+            }
+            uLong strip_adler = adler32(adler32(0L, Z_NULL, 0), filtered.data(), filtered.size());
+
+            // length and type are filled in once the deflated size is known
+            chunk.resize(8);
+            deflateReset(&z);
+            z.next_in = filtered.data();
+            z.avail_in = filtered.size();
+            int ret;
+            do {
+                size_t used = chunk.size();
+                chunk.resize(used + deflateBound(&z, z.avail_in) + 16);
+                z.next_out = &chunk[used];
+                z.avail_out = chunk.size() - used;
+                ret = deflate(&z, n == rows - 1 ? Z_FINISH : Z_SYNC_FLUSH);
+                chunk.resize(chunk.size() - z.avail_out);
+                if (ret != Z_OK && ret != Z_STREAM_END && ret != Z_BUF_ERROR) {
+                    failed = 1;
+                    break;
+                }
+            } while (z.avail_out == 0);
+            // the last strip has to close the stream
+            if (n == rows - 1 && ret != Z_STREAM_END)
+                failed = 1;
+            if (failed) {
+                trace_end();
+                take_turn(n, 0);
+                continue;
+            }
+
+            png_put_u32(&chunk[0], chunk.size() - 8);
+            memcpy(&chunk[4], "IDAT", 4);
+            size_t crc_at = chunk.size();
+            chunk.resize(crc_at + 4);
+            png_put_u32(&chunk[crc_at], crc32(0L, &chunk[4], crc_at - 4));
+            trace_end();
+            take_turn(n, strip_adler);
+        }
+        if (ready)
+            deflateEnd(&z);
+    }
+    if (!level)
+        tile_loader_join();
+
+    if (failed) {
+        dbgprint(0, "ERROR: Cannot deflate " + file_name);
+        stream.close();
+        return 1;
+    }
+
+    unsigned char trailer[4];
+    png_put_u32(trailer, adler);
+    png_write_chunk(stream, "IDAT", trailer, sizeof(trailer));
+    png_write_chunk(stream, "IEND", NULL, 0);
+
+    stream.close();
+    return stream ? 0 : 1;
+}
+#endif
+
+// name of a preview file, FILE_OUT with _preview<scale> before the extension
+string preview_file_name(int level)
+{
+    string suffix = "_preview" + to_string(1 << level);
+    size_t dot = FILE_OUT.rfind('.');
+    if (dot == string::npos || FILE_OUT.find('/', dot) != string::npos)
+        return FILE_OUT + suffix;
+    return FILE_OUT.substr(0, dot) + suffix + FILE_OUT.substr(dot);
+}
+
+// writes low resolution mosaics from the same tile assignments as the full write
+// coarsest level first so operators have something to look at within seconds
+void write_preview_imgs()
+{
+    // a shard's previews would be nearly all empty
+    if (PREVIEW_LEVELS <= 0 || SHARD_COUNT > 1)
+        return;
+    trace_scope scope("previews");
+
+    tile_pyramid_build(PREVIEW_LEVELS);
+    for (int level = PREVIEW_LEVELS; level >= 1; level--) {
+        int failed;
+#if PNG_OUTPUT
+        if (png_file_name(FILE_OUT))
+            failed = write_png_img(preview_file_name(level), level);
+        else
+#endif
+        failed = write_stream_img(preview_file_name(level), level);
+        if (!failed)
+            dbgprint(1, "Wrote preview " + preview_file_name(level));
+    }
+}
+
+// composites the mosaic directly into a memory mapped FILE_OUT
+// every thread writes its tiles at their final file offset, the OS flushes pages
+// in the background so the disk is busy while the CPUs are compositing
+// returns 0 for success, 1 for failure
+int write_mapped_img()
+{
+    // components that were not weighed from the cache are read while the file is mapped and filled
+    tile_cache_prefetch_placed();
+
+    size_t header_bytes;
+    {
+        ofstream stream(FILE_OUT.c_str(), ios::binary);
+        if (!stream) {
+            dbgprint(0, "ERROR: Cannot open FILE_OUT for writing");
+            tile_loader_join();
+            return 1;
+        }
+        bitmap_image().save_header(stream, mosaic.width, mosaic.height);
+        header_bytes = (size_t) stream.tellp();
+    }
+
+    // BMP scanlines are padded to 4 bytes and stored bottom row first
+    size_t line_bytes = ((size_t) mosaic.width * 3 + 3) & ~(size_t) 3;
+    size_t file_bytes = header_bytes + line_bytes * mosaic.height;
+
+    int fd = open(FILE_OUT.c_str(), O_RDWR);
+    // the extended area reads back as zeros, which also covers the row padding
+    if (fd < 0 || ftruncate(fd, (off_t) file_bytes) != 0) {
+        dbgprint(0, "ERROR: Cannot size FILE_OUT for mapping");
+        if (fd >= 0)
+            close(fd);
+        tile_loader_join();
+        return 1;
+    }
+
+    void* mapping = mmap(NULL, file_bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (mapping == MAP_FAILED) {
+        dbgprint(0, "ERROR: Cannot map FILE_OUT");
+        close(fd);
+        tile_loader_join();
+        return 1;
+    }
+
+    // top scanline of the mosaic is the last one in the file
+    unsigned char* top_line = (unsigned char*) mapping + header_bytes + line_bytes * (mosaic.height - 1);
+
+    pool_for(mosaic.rows, [&](int row) {
+        trace_begin("write");
+        for (int tile_index = row * mosaic.cols; tile_index < (row + 1) * mosaic.cols; tile_index++) {
+            dbglog(2, "Placing tile %d", tile_index);
+
+            tile_blit(tile_index, top_line - line_bytes * tile_y(tile_index) + tile_x(tile_index) * 3, -(ptrdiff_t) line_bytes);
+        }
+        trace_end();
+    });
+    tile_loader_join();
+
+    int failed = munmap(mapping, file_bytes) != 0;
+    failed |= close(fd) != 0;
+    return failed;
+}
+
+
+/***********************************************/
+/*************** COLOR FUNCTIONS ***************/
+/***********************************************/
+
+// scores are squared distances scaled to keep some precision as an int
+#if GPU_OFFLOAD
+#pragma omp declare target
+#endif
+#if COLOR_SPACE == 1
+const float COLOR_SCORE_SCALE = 64.0f;
+#else
+const float COLOR_SCORE_SCALE = 1.0f;
+#endif
+#if GPU_OFFLOAD
+#pragma omp end declare target
+#endif
+
+// sRGB channel to linear light
+inline float srgb_to_linear(float c)
+{
+    c /= 255.0f;
+    return c <= 0.04045f ? c / 12.92f : pow((c + 0.055f) / 1.055f, 2.4f);
+}
+
+inline float lab_f(float t)
+{
+    return t > 0.008856f ? cbrt(t) : 7.787f * t + 16.0f / 116.0f;
+}
+
+// converts a weight into COLOR_SPACE coordinates
+// rgb: color to convert
+// out: 3 coordinates, squared euclidean distance between them is the score
+void color_convert(const rgb_t& rgb, float out[3])
+{
+#if COLOR_SPACE == 1
+    // sRGB (D65) -> XYZ -> CIELAB
+    float r = srgb_to_linear(rgb.red);
+    float g = srgb_to_linear(rgb.green);
+    float b = srgb_to_linear(rgb.blue);
+    float x = (0.4124f * r + 0.3576f * g + 0.1805f * b) / 0.95047f;
+    float y = (0.2126f * r + 0.7152f * g + 0.0722f * b);
+    float z = (0.0193f * r + 0.1192f * g + 0.9505f * b) / 1.08883f;
+    float fx = lab_f(x), fy = lab_f(y), fz = lab_f(z);
+    out[0] = 116.0f * fy - 16.0f;
+    out[1] = 500.0f * (fx - fy);
+    out[2] = 200.0f * (fy - fz);
+#else
+    out[0] = rgb.red;
+    out[1] = rgb.green;
+    out[2] = rgb.blue;
+#endif
+}
+
+// converts every component weight into the cmp_color arrays
+// must be called after get_component_file_weight()
+void build_component_colors()
+{
+    // pad to a multiple of 16 so the kernel never needs a scalar tail
+    size_t padded = (components_size + 15) & ~(size_t) 15;
+    for (int c = 0; c < 3; c++)
+        cmp_color[c].assign(padded, 0.0f);
+
+    for (int n = 0; n < components_size; n++) {
+        float color[3];
+        color_convert(component_rgb[n], color);
+        for (int c = 0; c < 3; c++)
+            cmp_color[c][n] = color[c];
+    }
+}
+
+// scores every component against a color
+// query: tile color in COLOR_SPACE coordinates
+// scores: receives a scaled squared distance for each component (padded length)
+void color_score_kernel(const float query[3], int* scores)
+{
+    const float* c0 = cmp_color[0].data();
+    const float* c1 = cmp_color[1].data();
+    const float* c2 = cmp_color[2].data();
+    int count = (int) cmp_color[0].size();
+
+#if defined(__AVX2__)
+    // 16 components per iteration, two 8 wide lanes
+    const __m256 q0 = _mm256_set1_ps(query[0]);
+    const __m256 q1 = _mm256_set1_ps(query[1]);
+    const __m256 q2 = _mm256_set1_ps(query[2]);
+    const __m256 scale = _mm256_set1_ps(COLOR_SCORE_SCALE);
+    for (int n = 0; n < count; n += 16) {
+        for (int k = n; k < n + 16; k += 8) {
+            __m256 d0 = _mm256_sub_ps(_mm256_loadu_ps(c0 + k), q0);
+            __m256 d1 = _mm256_sub_ps(_mm256_loadu_ps(c1 + k), q1);
+            __m256 d2 = _mm256_sub_ps(_mm256_loadu_ps(c2 + k), q2);
+            __m256 dist = _mm256_add_ps(_mm256_mul_ps(d0, d0), _mm256_add_ps(_mm256_mul_ps(d1, d1), _mm256_mul_ps(d2, d2)));
+            _mm256_storeu_si256((__m256i*) (scores + k), _mm256_cvttps_epi32(_mm256_mul_ps(dist, scale)));
+        }
+    }
+#elif defined(__ARM_NEON)
+    // 16 components per iteration, four 4 wide lanes
+    const float32x4_t q0 = vdupq_n_f32(query[0]);
+    const float32x4_t q1 = vdupq_n_f32(query[1]);
+    const float32x4_t q2 = vdupq_n_f32(query[2]);
+    for (int n = 0; n < count; n += 16) {
+        for (int k = n; k < n + 16; k += 4) {
+            float32x4_t d0 = vsubq_f32(vld1q_f32(c0 + k), q0);
+            float32x4_t d1 = vsubq_f32(vld1q_f32(c1 + k), q1);
+            float32x4_t d2 = vsubq_f32(vld1q_f32(c2 + k), q2);
+            float32x4_t dist = vmlaq_f32(vmlaq_f32(vmulq_f32(d0, d0), d1, d1), d2, d2);
+            vst1q_s32(scores + k, vcvtq_s32_f32(vmulq_n_f32(dist, COLOR_SCORE_SCALE)));
+        }
+    }
+#else
+#pragma omp simd
+    for (int n = 0; n < count; n++) {
+        float d0 = c0[n] - query[0];
+        float d1 = c1[n] - query[1];
+        float d2 = c2[n] - query[2];
+        scores[n] = (int) ((d0 * d0 + d1 * d1 + d2 * d2) * COLOR_SCORE_SCALE);
+    }
+#endif
+}
+
+
+/***********************************************/
+/*********** NEAREST NEIGHBOUR FUNCTIONS *******/
+/***********************************************/
+
+// squared distance from the query to the closest point of a subtree's box
+inline float kd_box_dist(const kd_cursor& cursor, const kd_node& node)
+{
+    float dist = 0;
+    for (int axis = 0; axis < 3; axis++) {
+        float d = 0;
+        if (cursor.query[axis] < node.min[axis])
+            d = node.min[axis] - cursor.query[axis];
+        else if (cursor.query[axis] > node.max[axis])
+            d = cursor.query[axis] - node.max[axis];
+        dist += d * d;
+    }
+    return dist;
+}
+
+// min heap order, ties go to the lower node so results are stable
+inline bool kd_heap_compare(const kd_candidate& a, const kd_candidate& b)
+{
+    if (a.dist != b.dist)
+        return a.dist > b.dist;
+    return a.lo > b.lo;
+}
+
+// builds the subtree [lo, hi) out of the component indexes in kd_tree
+void kd_build_range(int lo, int hi)
+{
+    if (lo >= hi)
+        return;
+
+    // split along the widest color channel
+    float min[3] = { FLT_MAX, FLT_MAX, FLT_MAX };
+    float max[3] = { -FLT_MAX, -FLT_MAX, -FLT_MAX };
+    for (int n = lo; n < hi; n++)
+        for (int axis = 0; axis < 3; axis++) {
+            float v = cmp_color[axis][kd_tree[n].index];
+            if (v < min[axis]) min[axis] = v;
+            if (v > max[axis]) max[axis] = v;
+        }
+
+    int axis = 0;
+    for (int a = 1; a < 3; a++)
+        if (max[a] - min[a] > max[axis] - min[axis])
+            axis = a;
+
+    int mid = (lo + hi) / 2;
+    nth_element(kd_tree.begin() + lo, kd_tree.begin() + mid, kd_tree.begin() + hi,
+        [axis](const kd_node& a, const kd_node& b) {
+            float va = cmp_color[axis][a.index];
+            float vb = cmp_color[axis][b.index];
+            return va != vb ? va < vb : a.index < b.index;
+        });
+
+    kd_tree[mid].axis = axis;
+    memcpy(kd_tree[mid].min, min, sizeof(min));
+    memcpy(kd_tree[mid].max, max, sizeof(max));
+
+    kd_build_range(lo, mid);
+    kd_build_range(mid + 1, hi);
+}
+
+// builds the k-d tree over every component's weight
+// must be called after build_component_colors()
+void kd_build()
+{
+    kd_tree.resize(components_size);
+    for (int n = 0; n < components_size; n++)
+        kd_tree[n].index = n;
+
+    kd_build_range(0, components_size);
+}
+
+// starts an incremental nearest neighbour search around a tile's color
+void kd_cursor_start(kd_cursor& cursor, const rgb_t& rgb)
+{
+    color_convert(rgb, cursor.query);
+    cursor.heap.clear();
+
+    if (components_size > 0) {
+        kd_candidate root;
+        root.lo = 0;
+        root.hi = components_size;
+        root.dist = kd_box_dist(cursor, kd_tree[(root.lo + root.hi) / 2]);
+        cursor.heap.push_back(root);
+    }
+}
+
+// returns the next closest component, -1 once every component has been returned
+int kd_cursor_next(kd_cursor& cursor)
+{
+    while (!cursor.heap.empty()) {
+        pop_heap(cursor.heap.begin(), cursor.heap.end(), kd_heap_compare);
+        kd_candidate top = cursor.heap.back();
+        cursor.heap.pop_back();
+
+        // nothing left in the heap can be closer than this component
+        if (top.hi < 0)
+            return kd_tree[top.lo].index;
+
+        // open the subtree: its split component plus both children
+        int mid = (top.lo + top.hi) / 2;
+        int img_index = kd_tree[mid].index;
+        kd_candidate point;
+        point.lo = mid;
+        point.hi = -1;
+        point.dist = 0;
+        for (int axis = 0; axis < 3; axis++) {
+            float d = cmp_color[axis][img_index] - cursor.query[axis];
+            point.dist += d * d;
+        }
+        cursor.heap.push_back(point);
+        push_heap(cursor.heap.begin(), cursor.heap.end(), kd_heap_compare);
+
+        int child_lo[2] = { top.lo, mid + 1 };
+        int child_hi[2] = { mid, top.hi };
+        for (int c = 0; c < 2; c++) {
+            if (child_lo[c] >= child_hi[c])
+                continue;
+            kd_candidate child;
+            child.lo = child_lo[c];
+            child.hi = child_hi[c];
+            child.dist = kd_box_dist(cursor, kd_tree[(child.lo + child.hi) / 2]);
+            cursor.heap.push_back(child);
+            push_heap(cursor.heap.begin(), cursor.heap.end(), kd_heap_compare);
+        }
+    }
+
+    return -1;
+}
+
+void tile_rank_top_k(unsigned int tile_index, int first);
+
+// starts walking a tile's candidates from best to worst
+void rank_cursor_start(rank_cursor& cursor, unsigned int tile_index)
+{
+    cursor.tile_index = tile_index;
+    cursor.n = 0;
+#if RANK_MODE == 1
+    kd_cursor_start(cursor.kd, tile_rgb[tile_index]);
+#endif
+}
+
+// returns the next best component for the cursor's tile, -1 when out of candidates
+int rank_cursor_next(rank_cursor& cursor)
+{
+    trace_candidate();
+#if RANK_MODE == 1
+    return kd_cursor_next(cursor.kd);
+#elif RANK_MODE == 2
+    if (cursor.n >= components_size)
+        return -1;
+    // walked past the candidates we kept, rank the next batch
+    int base = tile_top_k_base[cursor.tile_index];
+    if (cursor.n < base || cursor.n >= base + RANK_TOP_K) {
+        tile_rank_top_k(cursor.tile_index, cursor.n);
+        base = cursor.n;
+    }
+    return tile_top_k[(size_t) cursor.tile_index * RANK_TOP_K + cursor.n++ - base].index;
+#else
+    if (cursor.n >= components_size)
+        return -1;
+    return tile_map[cursor.tile_index][cursor.n++].index;
+#endif
+}
+
+
+/*********************************************/
+/*************** FIT FUNCTIONS ***************/
+/*********************************************/
+
+// placements of a component this process may use
+// shards split each component's TILE_RPT_COUNT evenly, the remainder goes to different shards for
+// different components, so all shards together never place it more than TILE_RPT_COUNT times
+inline int fit_limit(int img_index)
+{
+    if (SHARD_COUNT <= 1)
+        return TILE_RPT_COUNT;
+    int extra = (img_index + SHARD_INDEX) % SHARD_COUNT < TILE_RPT_COUNT % SHARD_COUNT;
+    return TILE_RPT_COUNT / SHARD_COUNT + extra;
+}
+
+// checks a component may go on a tile of this shard's halo
+// the TILE_MIN_DIST rows either side of a band boundary are the only tiles a neighbouring shard
+// can see, the band above the boundary uses even components there and the band below odd ones
+// returns 1 if allowed
+inline int fit_halo_allowed(unsigned int tile_index, int img_index)
+{
+    if (SHARD_COUNT <= 1)
+        return 1;
+    int row = tile_index / mosaic.cols;
+    if (SHARD_INDEX > 0 && row < shard_row_begin + TILE_MIN_DIST && img_index % 2 == 0)
+        return 0;
+    if (SHARD_INDEX < SHARD_COUNT - 1 && row >= shard_row_end - TILE_MIN_DIST && img_index % 2 == 1)
+        return 0;
+    return 1;
+}
+
+// chooses the best available image, allows repeats without care
+// tile_index: current tile to map an image to
+// returns best fitting image
+int fit_best_pick(unsigned int tile_index)
+{
+    rank_cursor cursor;
+    rank_cursor_start(cursor, tile_index);
+    int img_index = rank_cursor_next(cursor);
+    int next;
+    int depth = 1;
+
+    // choose first best pick that isnt repeated as much
+    while (component_placed[img_index] >= fit_limit(img_index) && (next = rank_cursor_next(cursor)) >= 0) {
+        img_index = next;
+        depth++;
+    }
+
+    trace_pick(depth);
+    return img_index;
+}
+
+// checks around if we've used the tile before
 // if TILE_MIN_DIST is too high, we could run out of images to use
 // tile_index: reference tile to check around
 // img_index: image we do not want to repeat
 // returns 0 for no repeats, 1 for a repeat seen
 int fit_check_repeated(unsigned int tile_index, unsigned int img_index)
 {
-    int seen = 0;
-    // check in an area around us
-//#pragma omp parallel for num_threads(numthreads) shared(seen)
-    for (int row = -TILE_MIN_DIST; row <= TILE_MIN_DIST; row++) {
-        for (int col = -TILE_MIN_DIST; col <= TILE_MIN_DIST; col++) {
-            int r = tile_index / mosaic.cols + row;
-            int c = tile_index % mosaic.cols + col;
-            int loc = r * mosaic.cols + c;
-            // end thread prematurely if we've seen an item
-            if (seen)
-                break;
-
-            // check if we've seen this item
-            if (loc < TOTAL_TILES && loc >= 0)
-            if (tiles[loc].img_index == img_index) {
-                //#pragma critical
-                seen += 1;
-                break;
-            }
+    // only the places this image already went can break the rule,
+    // so this costs at most TILE_RPT_COUNT compares whatever TILE_MIN_DIST is
+    int row = tile_index / mosaic.cols;
+    int col = tile_index % mosaic.cols;
+    int count = min_n(component_placed[img_index], TILE_RPT_COUNT);
+    const int* placed_at = &placed_tiles[(size_t) img_index * TILE_RPT_COUNT];
+
+    for (int n = 0; n < count; n++) {
+        int r = placed_at[n] / mosaic.cols;
+        int c = placed_at[n] % mosaic.cols;
+        if (abs(r - row) <= TILE_MIN_DIST && abs(c - col) <= TILE_MIN_DIST) {
+            trace_probe(n + 1);
+            return 1;
         }
-        // end thread prematurely if we've seen an item
-        //if (seen)
-            //break;
     }
 
-    return seen;
+    trace_probe(count);
+    return 0;
 }
 
 // chooses the best available image
 // does not allow repeats within a region
 // tile_index: current tile to map an image to
+// usable: set to 1 if the pick meets both rules, 0 if it is only the fallback
 // returns best fitting image
-int fit_best_pick_sparse(unsigned int tile_index)
+int fit_best_pick_sparse(unsigned int tile_index, int* usable = NULL)
 {
-    int n = 0;
-    int img_index = tile_map[tile_index][n].index;
-    int seen = 1;
+    rank_cursor cursor;
+    rank_cursor_start(cursor, tile_index);
+    int img_index = -1;
+    int next;
 
     // choose first best pick that isnt repeated as much
     // keep looking for first usable picture
     // 1. do not exceed image list
     // 2. do not choose an image that's been placed too much
     // 3. do not choose an image that's been seen recently
-    while (n < components_size && (components[img_index].placed >= TILE_RPT_COUNT  || seen)) {
-        img_index = tile_map[tile_index][n].index;
-        seen = fit_check_repeated(tile_index, img_index);
-        n++;
+    // candidates come best first, so the search stops at the first usable one
+    // if nothing is usable the worst candidate is kept
+    int found = 0;
+    int depth = 0;
+    while ((next = rank_cursor_next(cursor)) >= 0) {
+        img_index = next;
+        depth++;
+        if (component_placed[img_index] < fit_limit(img_index) && fit_halo_allowed(tile_index, img_index)
+            && !fit_check_repeated(tile_index, img_index)) {
+            found = 1;
+            break;
+        }
     }
 
+    trace_pick(depth);
+    if (usable)
+        *usable = found;
     return img_index;
 }
 
+// saves a pick and claims a placement of its image
+// tile_index: tile the image goes on
+// img_index: image picked for the tile
+// usable: 1 to respect fit_limit(), 0 to place a fallback past the limit
+// returns 1 if the image was placed, 0 if its last placement was already taken
+int fit_place(unsigned int tile_index, int img_index, int usable)
+{
+    int slot;
+    if (usable) {
+        slot = component_placed[img_index].try_claim(fit_limit(img_index));
+        if (slot < 0)
+            return 0;
+    }
+    else
+        slot = component_placed[img_index].force_claim();
+
+    if (slot < TILE_RPT_COUNT)
+        placed_tiles[(size_t) img_index * TILE_RPT_COUNT + slot] = tile_index;
+    tile_img[tile_index] = img_index;
+    return 1;
+}
+
 // Populates tiles with images (does not write to disk)
 // tile_index: tile we want to find an image for
 // This uses a lot of memory
 void tile_place_best_fit(unsigned int tile_index)
 {
-    string output = "Best Fit Tile " + to_string(tile_index);
-    dbgprint(2, output);
-
     // note we can have more images than tiles we place
     // look for best fit image we can place
     //int img_index = fit_rand_pick(tile_index);
-    int img_index = fit_best_pick_sparse(tile_index);
+    int usable;
+    int img_index = fit_best_pick_sparse(tile_index, &usable);
 
     // found best fit, save index
-    tiles[tile_index].img_index = img_index;
-    components[img_index].placed++;
+    if (!fit_place(tile_index, img_index, usable))
+        fit_place(tile_index, img_index, 0);
 }
 
+// Populates every tile with an image (does not write to disk)
+// the grid is coloured into (TILE_MIN_DIST + 1)^2 sets, tiles of one colour are
+// more than TILE_MIN_DIST apart so their repeat checks never see each other
+// each colour is fitted in parallel, then committed in tile order so the result
+// does not depend on the thread count or on scheduling
+void fit_all_tiles()
+{
+    int spacing = TILE_MIN_DIST + 1;
+    placed_tiles.assign((size_t) components_size * TILE_RPT_COUNT, -1);
+
+    vector <int> pending;
+    vector <int> picks;
+    vector <int> usable;
+
+    for (int color_row = 0; color_row < spacing; color_row++)
+    for (int color_col = 0; color_col < spacing; color_col++) {
+        pending.clear();
+        for (int row = shard_row_begin + color_row; row < shard_row_end; row += spacing)
+            for (int col = color_col; col < mosaic.cols; col += spacing)
+                pending.push_back(row * mosaic.cols + col);
+
+        // a pick can lose its last free placement to an earlier tile of the same colour,
+        // those tiles pick again against the updated counters
+        while (!pending.empty()) {
+            int count = pending.size();
+            picks.resize(count);
+            usable.resize(count);
+
+            // tiles of one colour are already spread over the grid, each is its own task
+            pool_for(count, [&](int n) {
+                trace_begin("fit");
+                picks[n] = fit_best_pick_sparse(pending[n], &usable[n]);
+                trace_end();
+            });
+
+            int retry = 0;
+            for (int n = 0; n < count; n++)
+                if (!fit_place(pending[n], picks[n], usable[n]))
+                    pending[retry++] = pending[n];
+            pending.resize(retry);
+        }
+    }
+}
+
+
+// color error of placing a component on a tile, the same scaled distance the ranking uses
+// query: tile color in COLOR_SPACE coordinates
+inline int fit_cost(const float query[3], int img_index)
+{
+    float d0 = cmp_color[0][img_index] - query[0];
+    float d1 = cmp_color[1][img_index] - query[1];
+    float d2 = cmp_color[2][img_index] - query[2];
+    return (int) ((d0 * d0 + d1 * d1 + d2 * d2) * COLOR_SCORE_SCALE);
+}
+
+// checks two tiles are within TILE_MIN_DIST of each other, so they may not share a component
+inline int fit_tiles_near(int a, int b)
+{
+    return abs(a / mosaic.cols - b / mosaic.cols) <= TILE_MIN_DIST && abs(a % mosaic.cols - b % mosaic.cols) <= TILE_MIN_DIST;
+}
+
+// orders held bids by amount, ties go to the lower tile so results never depend on threads
+inline bool auction_bid_compare(const auction_bid& a, const auction_bid& b)
+{
+    if (a.amount != b.amount)
+        return a.amount > b.amount;
+    return a.tile_index < b.tile_index;
+}
+
+// Populates every tile with an image by auction (FIT_MODE 1)
+// a tile's benefit from a component is minus its color error, every component has
+// TILE_RPT_COUNT places and is priced at the lowest bid it holds once they are all taken
+// every round all unassigned tiles bid at once, then every component keeps its best bids
+// tiles only see their best FIT_CANDIDATES components and ask their rank cursor for the
+// next batch once everything listed costs more than an unlisted component could
+// eps is scaled down from coarse to 1 so early rounds settle the prices quickly
+// a component a tile within TILE_MIN_DIST holds is not a candidate, and a component keeps
+// no two bids that close, so every assignment already meets the repeat rule
+// with fewer places than tiles the auction could only fight over the places that are too few,
+// those grids are fitted greedily
+void fit_auction_tiles()
+{
+    long long capacity = 0;
+    for (int img = 0; img < components_size; img++)
+        capacity += fit_limit(img);
+    if (capacity < TOTAL_TILES) {
+        dbgprint(1, "Only " + to_string(capacity) + " places for " + to_string(TOTAL_TILES) + " tiles, fitting greedily");
+        fit_all_tiles();
+        return;
+    }
+
+    placed_tiles.assign((size_t) components_size * TILE_RPT_COUNT, -1);
+    int batch = max_n(FIT_CANDIDATES, 1);
+
+    // candidates listed so far per tile, best first, with their benefit
+    vector <rank_cursor> cursors(TOTAL_TILES);
+    vector <vector<int>> cand_img(TOTAL_TILES);
+    vector <vector<long long>> cand_benefit(TOTAL_TILES);
+    // 1 once a tile has listed every component
+    vector <char> listed_all(TOTAL_TILES, 0);
+    long long spread_max = 1;
+
+    // fetches the next batch of a tile's candidates, returns the number added
+    auto list_more = [&](int t) {
+        float query[3];
+        color_convert(tile_rgb[t], query);
+        int added = 0;
+        for (; added < batch; added++) {
+            int img_index = rank_cursor_next(cursors[t]);
+            if (img_index < 0) {
+                listed_all[t] = 1;
+                break;
+            }
+            cand_img[t].push_back(img_index);
+            cand_benefit[t].push_back(-(long long) fit_cost(query, img_index));
+        }
+        return added;
+    };
+
+    vector <long long> spread(TOTAL_TILES, 1);
+    pool_for(mosaic.rows, [&](int row) {
+        for (int t = row * mosaic.cols; t < (row + 1) * mosaic.cols; t++) {
+            rank_cursor_start(cursors[t], t);
+            if (list_more(t))
+                spread[t] = cand_benefit[t].front() - cand_benefit[t].back() + 1;
+        }
+    });
+    for (int t = 0; t < TOTAL_TILES; t++)
+        spread_max = max(spread_max, spread[t]);
+
+    vector <long long> price(components_size);
+    vector <vector<auction_bid>> held(components_size);
+    vector <int> assigned(TOTAL_TILES);
+    vector <char> exited(TOTAL_TILES);
+    vector <auction_bid> bids(TOTAL_TILES);
+    vector <int> active;
+    // bids regrouped by component, component n owns [bid_start[n], bid_start[n + 1])
+    vector <int> bid_start(components_size + 1);
+    vector <auction_bid> bid_sorted;
+    vector <int> bidders;
+
+    // a tile may not take a component that a tile within TILE_MIN_DIST holds
+    auto held_near = [&](int t, int img_index) {
+        const vector <auction_bid>& list = held[img_index];
+        for (size_t b = 0; b < list.size(); b++)
+            if (fit_tiles_near(list[b].tile_index, t))
+                return 1;
+        return 0;
+    };
+
+    // rounds without a new low in unassigned tiles before the auction gives up on them
+    const int stall_rounds = 64;
+    int stalled = 0;
+    int rounds = 0;
+    long long eps = max(spread_max / 16, 1LL);
+    for (;;) {
+        // each phase starts over with the prices the last one ended on
+        assigned.assign(TOTAL_TILES, -1);
+        exited.assign(TOTAL_TILES, 0);
+        for (int n = 0; n < components_size; n++)
+            held[n].clear();
+
+        int fewest = INT_MAX;
+        int since_fewest = 0;
+        for (; rounds < FIT_AUCTION_ROUNDS; rounds++) {
+            active.clear();
+            for (int t = 0; t < TOTAL_TILES; t++)
+                if (assigned[t] < 0 && !exited[t])
+                    active.push_back(t);
+            if (active.empty())
+                break;
+
+            // tiles that keep outbidding each other for the same places are left to the greedy fit
+            if ((int) active.size() < fewest) {
+                fewest = active.size();
+                since_fewest = 0;
+            }
+            else if (++since_fewest >= stall_rounds) {
+                stalled = 1;
+                break;
+            }
+
+            // bidding, prices are only read
+            // the last rounds only have a handful of bidders, not worth waking the threads for
+            pool_for((int) active.size(), [&](int n) {
+                int t = active[n];
+                int best;
+                long long best_value, second_value;
+                trace_begin("bid");
+                for (;;) {
+                    best = -1;
+                    best_value = second_value = LLONG_MIN;
+                    for (int k = 0; k < (int) cand_img[t].size(); k++) {
+                        if (held_near(t, cand_img[t][k]))
+                            continue;
+                        long long value = cand_benefit[t][k] - price[cand_img[t][k]];
+                        if (value > best_value) {
+                            second_value = best_value;
+                            best = k;
+                            best_value = value;
+                        }
+                        else if (value > second_value)
+                            second_value = value;
+                    }
+
+                    // an unlisted component is worth at most the last listed benefit (its price is >= 0)
+                    if (listed_all[t])
+                        break;
+                    long long unlisted = cand_benefit[t].back();
+                    if (best >= 0 && best_value >= unlisted) {
+                        second_value = max(second_value, unlisted);
+                        break;
+                    }
+                    list_more(t);
+                }
+                trace_end();
+
+                // paying more than the whole color range for a place is not worth it, leave the
+                // tile to the greedy fit
+                if (best < 0 || price[cand_img[t][best]] > spread_max) {
+                    exited[t] = 1;
+                    bids[t].tile_index = -1;
+                    return;
+                }
+                // a single candidate has nothing to lose to, bid just past the price
+                if (second_value == LLONG_MIN)
+                    second_value = best_value;
+                bids[t].amount = cand_benefit[t][best] - second_value + eps;
+                bids[t].tile_index = t;
+                bids[t].candidate = best;
+            }, 256);
+
+            // group the bids by component
+            bid_start.assign(components_size + 1, 0);
+            for (size_t n = 0; n < active.size(); n++) {
+                const auction_bid& bid = bids[active[n]];
+                if (bid.tile_index >= 0)
+                    bid_start[cand_img[bid.tile_index][bid.candidate] + 1]++;
+            }
+            for (int n = 0; n < components_size; n++)
+                bid_start[n + 1] += bid_start[n];
+            bid_sorted.resize(bid_start[components_size]);
+            bidders.clear();
+            {
+                vector <int> fill(bid_start.begin(), bid_start.end() - 1);
+                for (size_t n = 0; n < active.size(); n++) {
+                    const auction_bid& bid = bids[active[n]];
+                    if (bid.tile_index < 0)
+                        continue;
+                    int img_index = cand_img[bid.tile_index][bid.candidate];
+                    if (fill[img_index] == bid_start[img_index])
+                        bidders.push_back(img_index);
+                    bid_sorted[fill[img_index]++] = bid;
+                }
+            }
+
+            // every component with new bids keeps its TILE_RPT_COUNT best, tiles only
+            // ever sit in one component's list so the components resolve in parallel
+            pool_for((int) bidders.size(), [&](int n) {
+                int img_index = bidders[n];
+                vector <auction_bid>& list = held[img_index];
+                list.insert(list.end(), bid_sorted.begin() + bid_start[img_index], bid_sorted.begin() + bid_start[img_index + 1]);
+                sort(list.begin(), list.end(), auction_bid_compare);
+
+                // best bids first, a bid within TILE_MIN_DIST of one already kept loses
+                size_t kept = 0;
+                for (size_t b = 0; b < list.size(); b++) {
+                    int keep = kept < (size_t) TILE_RPT_COUNT;
+                    for (size_t k = 0; keep && k < kept; k++)
+                        keep = !fit_tiles_near(list[k].tile_index, list[b].tile_index);
+                    assigned[list[b].tile_index] = keep ? img_index : -1;
+                    if (keep)
+                        list[kept++] = list[b];
+                }
+                list.resize(kept);
+                price[img_index] = kept == (size_t) TILE_RPT_COUNT ? list[kept - 1].amount : 0;
+            }, 64);
+        }
+
+        if (eps == 1 || stalled || rounds >= FIT_AUCTION_ROUNDS)
+            break;
+        eps = max(eps / 4, 1LL);
+    }
+
+    // commit in tile order, the repeat check only guards against a held list that was cut short
+    long long error = 0;
+    int fallback = 0;
+    for (int t = 0; t < TOTAL_TILES; t++) {
+        int img_index = assigned[t];
+        if (img_index >= 0 && !fit_check_repeated(t, img_index) && fit_place(t, img_index, 1)) {
+            for (size_t k = 0; k < cand_img[t].size(); k++)
+                if (cand_img[t][k] == img_index)
+                    error -= cand_benefit[t][k];
+        }
+        else
+            assigned[t] = -1;
+    }
+
+    // those and the tiles that gave up bidding take what the greedy fit can still give them
+    for (int t = 0; t < TOTAL_TILES; t++)
+        if (assigned[t] < 0) {
+            tile_place_best_fit(t);
+            fallback++;
+        }
+
+    string output = "Auction fitted " + to_string(TOTAL_TILES - fallback) + " tiles in " + to_string(rounds) + " rounds";
+    output += " (error " + to_string(error) + ", " + to_string(fallback) + " fitted greedily)";
+    dbgprint(1, output);
+}
 
 /**********************************************/
 /*************** RANK FUNCTIONS ***************/
@@ -431,7 +2534,56 @@ void tile_place_best_fit(unsigned int tile_index)
 // compares two tiles values
 bool compare_tiles(const mosaic_map& img1, const mosaic_map& img2)
 {
-    return abs(img1.value) < abs(img2.value);
+    return img1.value < img2.value;
+}
+
+// compares two tiles values, equal values keep component order
+// gives a strict order so batches of a ranking never overlap
+bool compare_tiles_stable(const mosaic_map& img1, const mosaic_map& img2)
+{
+    if (img1.value != img2.value)
+        return img1.value < img2.value;
+    return img1.index < img2.index;
+}
+
+// squeezes a color_score_kernel() score into the 16 bits of a mosaic_map value
+// scores below 32768 are kept exactly, past that the distance (not squared) is stored in 1/64 steps
+// close matches keep their order, far ones may tie
+#if GPU_OFFLOAD
+#pragma omp declare target
+#endif
+inline uint16_t rank_score(int score)
+{
+    if (score < 32768)
+        return (uint16_t) score;
+    float far = (sqrtf((float) score / COLOR_SCORE_SCALE) - sqrtf(32768.0f / COLOR_SCORE_SCALE)) * 64.0f;
+    return far < 32767.0f ? (uint16_t) (32768.0f + far) : 65535;
+}
+#if GPU_OFFLOAD
+#pragma omp end declare target
+#endif
+
+// scores every component against a tile
+// tile_index: tile we want to rank images on
+// ranking: receives one entry per component, unsorted
+void tile_score_all(unsigned int tile_index, mosaic_map* ranking)
+{
+    // vectorized distances for the whole image set, reused by every tile on this thread
+    static thread_local vector <int> scores;
+    scores.resize(cmp_color[0].size());
+
+    float query[3];
+    color_convert(tile_rgb[tile_index], query);
+    color_score_kernel(query, scores.data());
+
+    // note we can have more images than tiles we place
+    // for each image, check their weighting and add it into the list
+    for(int n = 0; n < components_size; n++) {
+        ranking[n].index = n;
+        // squared distance between the weights (0 being most preferred match)
+        // every channel counts, errors in one channel can no longer cancel another
+        ranking[n].value = rank_score(scores[n]);
+    }
 }
 
 // Ranks all the images in order for a given tile
@@ -439,103 +2591,545 @@ bool compare_tiles(const mosaic_map& img1, const mosaic_map& img2)
 // This uses a lot of memory
 void tile_rank_fits(unsigned int tile_index)
 {
-    //tiles[tile_index]
     tile_map[tile_index].resize(components_size);
 
-    string output = "Ranking Tile " + to_string(tile_index) + " Thread: ";
-    dbgprint(2, output);
+    tile_score_all(tile_index, tile_map[tile_index].data());
 
-    // note we can have more images than tiles we place
-    // for each image, check their weighting and add it into the list
-    for(int n = 0; n < components_size; n++) {
-        int r = (int)components[n].rgb.red - (int)tiles[tile_index].rgb.red;
-        int g = (int)components[n].rgb.green - (int)tiles[tile_index].rgb.green;
-        int b = (int)components[n].rgb.blue - (int)tiles[tile_index].rgb.blue;
+    // biggest bottle neck for high tile images
+    // equal scores keep component order, so the ranking is the one tile_rank_top_k() gives
+    sort(tile_map[tile_index].begin(), tile_map[tile_index].end(), compare_tiles_stable);
+}
+
+// Keeps only ranks [first, first + RANK_TOP_K) of a tile's ranking
+// tile_index: tile we want to rank images on
+// first: rank of the first candidate to keep, 0 for the best matches
+// memory stays at RANK_TOP_K entries per tile however big the image set is
+void tile_rank_top_k(unsigned int tile_index, int first)
+{
+    // scratch buffer for the full scoring, reused by every tile on this thread
+    static thread_local vector <mosaic_map> ranking;
+    ranking.resize(components_size);
+    tile_score_all(tile_index, ranking.data());
+
+    int last = min_n(first + RANK_TOP_K, components_size);
+    if (first >= last)
+        return;
+
+    // only partially order the list around the batch we keep
+    if (first > 0)
+        nth_element(ranking.begin(), ranking.begin() + first, ranking.end(), compare_tiles_stable);
+    partial_sort(ranking.begin() + first, ranking.begin() + last, ranking.end(), compare_tiles_stable);
+
+    copy(ranking.begin() + first, ranking.begin() + last, tile_top_k.begin() + (size_t) tile_index * RANK_TOP_K);
+    tile_top_k_base[tile_index] = first;
+}
 
-        // take root mean square average (simple average results in image being dark)
-        tile_map[tile_index][n].index = n;
-        // we want the absolute distance (0 being most preferred match)
-        tile_map[tile_index][n].value = abs(r + g + b);
+#if GPU_OFFLOAD
+// ranks the first RANK_TOP_K candidates of every tile in the shard in one device kernel
+// the component and tile colors go over once, every tile keeps its best keys sorted by insertion
+// (rank_score() in the high half, component in the low half, the same order compare_tiles_stable() gives)
+// and the lists come back as the first batch of tile_top_k, later batches are still ranked by tile_rank_top_k()
+// must be called after build_component_colors()
+void gpu_rank_top_k()
+{
+    dbgprint(1, omp_get_num_devices() > 0 ? "Ranking on device " + to_string(omp_get_default_device())
+                                          : "No offload device, ranking kernel runs on the host");
+
+    int k = min_n(RANK_TOP_K, components_size);
+    int n = components_size;
+    int first_tile = shard_row_begin * mosaic.cols;
+    int count = (shard_row_end - shard_row_begin) * mosaic.cols;
+    if (k <= 0 || count <= 0)
+        return;
+
+    vector <float> query((size_t) count * 3);
+    for (int t = 0; t < count; t++)
+        color_convert(tile_rgb[first_tile + t], &query[(size_t) t * 3]);
+    vector <unsigned long long> keys((size_t) count * k);
+
+    const float* c0 = cmp_color[0].data();
+    const float* c1 = cmp_color[1].data();
+    const float* c2 = cmp_color[2].data();
+    const float* q = query.data();
+    unsigned long long* out = keys.data();
+
+    trace_begin("rank");
+#pragma omp target teams distribute parallel for map(to: c0[0:n], c1[0:n], c2[0:n], q[0:count * 3]) map(from: out[0:count * k])
+    for (int t = 0; t < count; t++) {
+        unsigned long long* list = out + (size_t) t * k;
+        int size = 0;
+        for (int img = 0; img < n; img++) {
+            // same distance as fit_cost()
+            float d0 = c0[img] - q[t * 3];
+            float d1 = c1[img] - q[t * 3 + 1];
+            float d2 = c2[img] - q[t * 3 + 2];
+            unsigned long long key = ((unsigned long long) rank_score((int) ((d0 * d0 + d1 * d1 + d2 * d2) * COLOR_SCORE_SCALE)) << 32) | img;
+            if (size == k && key >= list[k - 1])
+                continue;
+            int pos = size < k ? size++ : k - 1;
+            for (; pos > 0 && list[pos - 1] > key; pos--)
+                list[pos] = list[pos - 1];
+            list[pos] = key;
+        }
     }
+    trace_end();
 
-    // biggest bottle neck for high tile images
-    sort(tile_map[tile_index].begin(), tile_map[tile_index].end(), compare_tiles);
+    for (int t = 0; t < count; t++) {
+        mosaic_map* ranking = &tile_top_k[(size_t) (first_tile + t) * RANK_TOP_K];
+        for (int j = 0; j < k; j++) {
+            ranking[j].index = (uint32_t) keys[(size_t) t * k + j];
+            ranking[j].value = (uint16_t) (keys[(size_t) t * k + j] >> 32);
+        }
+        tile_top_k_base[first_tile + t] = 0;
+    }
 }
+#endif
 
 
 /***********************************************/
-/*************** INPUT FUNCTIONS ***************/
+/*************** INDEX FUNCTIONS ***************/
 /***********************************************/
-int get_component_file_weight()
+
+// first bytes of an index file, bump the version when the layout changes
+const char INDEX_MAGIC[8] = { 'M', 'O', 'S', 'I', 'D', 'X', '0', '1' };
+
+// loads FILE_INDEX into component_index
+// returns number of entries loaded, 0 if there is no usable index
+int component_index_load()
 {
-    struct dirent **files;
-    int img = 0;
+    component_index.clear();
+    component_index_width = component_index_height = 0;
+    if (FILE_INDEX.empty())
+        return 0;
+
+    ifstream stream(FILE_INDEX.c_str(), ios::binary);
+    if (!stream)
+        return 0;
+
+    char magic[8];
+    unsigned int count = 0;
+    stream.read(magic, sizeof(magic));
+    stream.read((char*) &component_index_width, sizeof(component_index_width));
+    stream.read((char*) &component_index_height, sizeof(component_index_height));
+    stream.read((char*) &count, sizeof(count));
+    if (!stream || memcmp(magic, INDEX_MAGIC, sizeof(magic)) != 0) {
+        dbgprint(1, "Ignoring unreadable component index " + FILE_INDEX);
+        component_index_width = component_index_height = 0;
+        return 0;
+    }
 
-    // Scan files in directory
-    int n = scandir(DIR_IMG_PATH, &files, NULL, alphasort);
-    if (n >= 0) {
-        // Loop through file names
-        for (int i = 0; i < n; i++) {
-            struct dirent *ent;
-            // Get pointer to file entry
-            ent = files[i];
-            if (strcmp(ent->d_name, ".DS_Store") == 0)
-                continue;
-            // Output file name
-            switch (ent->d_type) {
-                case DT_REG:
-                    //printf("%s\n", ent->d_name);
-                    string fullpath = DIR_IMG_PATH;
-                    fullpath += "/";
-                    fullpath += ent->d_name;
+    for (unsigned int i = 0; i < count; i++) {
+        unsigned int path_len = 0;
+        stream.read((char*) &path_len, sizeof(path_len));
+        if (!stream || path_len > PATH_MAX)
+            break;
+
+        string path(path_len, '\0');
+        component_index_entry entry;
+        stream.read(&path[0], path_len);
+        stream.read((char*) &entry.mtime, sizeof(entry.mtime));
+        stream.read((char*) &entry.size, sizeof(entry.size));
+        stream.read((char*) &entry.width, sizeof(entry.width));
+        stream.read((char*) &entry.height, sizeof(entry.height));
+        stream.read((char*) &entry.rgb, sizeof(entry.rgb));
+        stream.read((char*) &entry.weighed, sizeof(entry.weighed));
+        if (!stream)
+            break;
+
+        component_index[path] = entry;
+    }
 
-                    string output = "Weighing File: " + fullpath;
-                    dbgprint(2, output);
-
-                    bitmap_image image(fullpath);
-
-                    // calculate image rgb
-                    if (img < components_size) {
-                        rgb_t rgb;
-                        float r = 0, g = 0, b = 0;
-                        int count = 0;
-
-#pragma omp parallel for num_threads(numthreads) reduction(+:r) reduction(+:g) reduction(+:b) reduction(+:count)
-                        for (int y = 0; y < mosaic.cmp_height; y++)
-                            for (size_t x = 0; x < mosaic.cmp_width; x++) {
-                                image.get_pixel(x, (size_t) y, rgb);
-                                r += rgb.red * rgb.red;
-                                g += rgb.green * rgb.green;
-                                b += rgb.blue * rgb.blue;
-                                count++;
-                            }
-
-                        // average weight for this image
-                        r = sqrt(r / count);
-                        g = sqrt(g / count);
-                        b = sqrt(b / count);
-                        components[img].rgb.red = r;
-                        components[img].rgb.green = g;
-                        components[img].rgb.blue = b;
-
-                        img++;
-                    }
+    return component_index.size();
+}
 
-                    break;
-            }
+// writes the current component list to FILE_INDEX
+// weights are stored for the current cmp_width x cmp_height
+// returns 0 for success, 1 for failure
+int component_index_save()
+{
+    if (FILE_INDEX.empty())
+        return 0;
+
+    ofstream stream(FILE_INDEX.c_str(), ios::binary);
+    if (!stream) {
+        dbgprint(1, "ERROR: Cannot write component index " + FILE_INDEX);
+        return 1;
+    }
+
+    unsigned int count = components.size();
+    stream.write(INDEX_MAGIC, sizeof(INDEX_MAGIC));
+    stream.write((const char*) &mosaic.cmp_width, sizeof(mosaic.cmp_width));
+    stream.write((const char*) &mosaic.cmp_height, sizeof(mosaic.cmp_height));
+    stream.write((const char*) &count, sizeof(count));
+
+    for (unsigned int i = 0; i < count; i++) {
+        const component_metadata& cmp = components[i];
+        unsigned int path_len = cmp.path.size();
+        stream.write((const char*) &path_len, sizeof(path_len));
+        stream.write(cmp.path.data(), path_len);
+        stream.write((const char*) &cmp.mtime, sizeof(cmp.mtime));
+        stream.write((const char*) &cmp.size, sizeof(cmp.size));
+        stream.write((const char*) &cmp.width, sizeof(cmp.width));
+        stream.write((const char*) &cmp.height, sizeof(cmp.height));
+        stream.write((const char*) &component_rgb[i], sizeof(rgb_t));
+        stream.write((const char*) &cmp.weighed, sizeof(cmp.weighed));
+    }
+
+    component_index_dirty = 0;
+    return stream ? 0 : 1;
+}
+
+// first bytes of a fit cache file, bump the version when the layout changes
+const char FIT_CACHE_MAGIC[8] = { 'M', 'O', 'S', 'F', 'I', 'T', '0', '1' };
+
+// FNV-1a over raw bytes
+// hash: running hash, start from fit_cache_seed
+inline unsigned long long hash_bytes(unsigned long long hash, const void* data, size_t bytes)
+{
+    const unsigned char* p = (const unsigned char*) data;
+    for (size_t n = 0; n < bytes; n++)
+        hash = (hash ^ p[n]) * 1099511628211ULL;
+    return hash;
+}
+const unsigned long long fit_cache_seed = 14695981039346656037ULL;
+
+// hash of everything the ranking depends on: the grid, the band, every tile and component
+// color and the ranking code paths, the files themselves do not matter once they are weighed
+// must be called after get_component_file_weight()
+unsigned long long fit_cache_layout_hash()
+{
+    int settings[7] = { mosaic.rows, mosaic.cols, shard_row_begin, shard_row_end, components_size, COLOR_SPACE, RANK_MODE };
+    unsigned long long hash = hash_bytes(fit_cache_seed, settings, sizeof(settings));
+#if RANK_MODE == 2
+    hash = hash_bytes(hash, &RANK_TOP_K, sizeof(RANK_TOP_K));
+#endif
+    hash = hash_bytes(hash, component_rgb.data(), (size_t) components_size * sizeof(rgb_t));
+    hash = hash_bytes(hash, tile_rgb.data(), (size_t) TOTAL_TILES * sizeof(rgb_t));
+    return hash;
+}
+
+// hash of everything the fitting depends on on top of the ranking
+unsigned long long fit_cache_fit_hash(unsigned long long layout_hash)
+{
+    int settings[7] = { TILE_RPT_COUNT, TILE_MIN_DIST, FIT_MODE, SHARD_COUNT, SHARD_INDEX, FIT_CANDIDATES, FIT_AUCTION_ROUNDS };
+    return hash_bytes(layout_hash, settings, sizeof(settings));
+}
+
+// restores the placements of a run with the same fit hash from FILE_FIT
+// returns 1 if every tile was restored, 0 if there is no matching cache (nothing is changed)
+int fit_cache_load(unsigned long long fit_hash)
+{
+    if (FILE_FIT.empty())
+        return 0;
+
+    ifstream stream(FILE_FIT.c_str(), ios::binary);
+    if (!stream)
+        return 0;
+
+    char magic[8];
+    unsigned long long hash = 0;
+    int rows = 0, cols = 0;
+    stream.read(magic, sizeof(magic));
+    stream.read((char*) &hash, sizeof(hash));
+    stream.read((char*) &rows, sizeof(rows));
+    stream.read((char*) &cols, sizeof(cols));
+    if (!stream || memcmp(magic, FIT_CACHE_MAGIC, sizeof(magic)) != 0 || hash != fit_hash
+        || rows != mosaic.rows || cols != mosaic.cols)
+        return 0;
+
+    vector <int32_t> picks(TOTAL_TILES);
+    vector <rgb_t> colors(TOTAL_TILES);
+    stream.read((char*) picks.data(), picks.size() * sizeof(int32_t));
+    stream.read((char*) colors.data(), colors.size() * sizeof(rgb_t));
+    if (!stream)
+        return 0;
+    for (int t = 0; t < TOTAL_TILES; t++)
+        if (picks[t] < -1 || picks[t] >= components_size)
+            return 0;
+
+    // placements are claimed again so the counters look the same as after fitting
+    placed_tiles.assign((size_t) components_size * TILE_RPT_COUNT, -1);
+    tile_rgb = colors;
+    for (int t = 0; t < TOTAL_TILES; t++) {
+        if (picks[t] >= 0)
+            fit_place(t, picks[t], 0);
+    }
+    return 1;
+}
+
+// saves the placements of every tile to FILE_FIT
+// tiles are stored as an image index array followed by the tile colors, 7 bytes a tile
+// returns 0 for success, 1 for failure
+int fit_cache_save(unsigned long long fit_hash)
+{
+    if (FILE_FIT.empty())
+        return 0;
+
+    // shards on shared storage may save at the same time, whoever renames last wins whole
+    string temp_name = FILE_FIT + ".tmp" + to_string(getpid());
+    {
+        ofstream stream(temp_name.c_str(), ios::binary);
+        if (!stream) {
+            dbgprint(1, "ERROR: Cannot write fit cache " + FILE_FIT);
+            return 1;
         }
-        // Release file names
-        for (int i = 0; i < n; i++) {
-            free(files[i]);
+
+        stream.write(FIT_CACHE_MAGIC, sizeof(FIT_CACHE_MAGIC));
+        stream.write((const char*) &fit_hash, sizeof(fit_hash));
+        stream.write((const char*) &mosaic.rows, sizeof(mosaic.rows));
+        stream.write((const char*) &mosaic.cols, sizeof(mosaic.cols));
+        stream.write((const char*) tile_img.data(), (size_t) TOTAL_TILES * sizeof(int32_t));
+        stream.write((const char*) tile_rgb.data(), (size_t) TOTAL_TILES * sizeof(rgb_t));
+        if (!stream) {
+            dbgprint(1, "ERROR: Cannot write fit cache " + FILE_FIT);
+            stream.close();
+            unlink(temp_name.c_str());
+            return 1;
         }
-        free(files);
+    }
 
+    return rename(temp_name.c_str(), FILE_FIT.c_str()) != 0;
+}
+
+// first bytes of a rank cache file, bump the version when the layout changes
+const char RANK_CACHE_MAGIC[8] = { 'M', 'O', 'S', 'R', 'N', 'K', '0', '1' };
+
+// restores the rankings of a run with the same layout hash from FILE_RANK
+// RANK_MODE 0 reads every shard tile's full ranking, RANK_MODE 2 the first RANK_TOP_K of each
+// returns 1 if every tile was restored, 0 if there is no matching cache (nothing is changed)
+int rank_cache_load(unsigned long long layout_hash)
+{
+#if RANK_MODE == 1
+    return 0;
+#else
+    if (FILE_RANK.empty())
+        return 0;
+
+    ifstream stream(FILE_RANK.c_str(), ios::binary);
+    if (!stream)
+        return 0;
+
+    char magic[8];
+    unsigned long long hash = 0;
+    int rows = 0, cols = 0;
+    stream.read(magic, sizeof(magic));
+    stream.read((char*) &hash, sizeof(hash));
+    stream.read((char*) &rows, sizeof(rows));
+    stream.read((char*) &cols, sizeof(cols));
+    if (!stream || memcmp(magic, RANK_CACHE_MAGIC, sizeof(magic)) != 0 || hash != layout_hash
+        || rows != mosaic.rows || cols != mosaic.cols)
+        return 0;
+
+    int first_tile = shard_row_begin * mosaic.cols;
+    int last_tile = shard_row_end * mosaic.cols;
+#if RANK_MODE == 2
+    vector <mosaic_map> ranking((size_t) TOTAL_TILES * RANK_TOP_K);
+    size_t first = (size_t) first_tile * RANK_TOP_K, count = (size_t) (last_tile - first_tile) * RANK_TOP_K;
+    stream.read((char*) &ranking[first], count * sizeof(mosaic_map));
+    if (!stream)
+        return 0;
+    // tiles with fewer components than RANK_TOP_K leave the tail of their slots unused
+    int kept = min_n(RANK_TOP_K, components_size);
+    for (int t = first_tile; t < last_tile; t++)
+        for (int k = 0; k < kept; k++)
+            if (ranking[(size_t) t * RANK_TOP_K + k].index >= (uint32_t) components_size)
+                return 0;
+
+    tile_top_k.swap(ranking);
+    tile_top_k_base.assign(TOTAL_TILES, 0);
+#else
+    vector <vector<mosaic_map>> ranking(TOTAL_TILES);
+    for (int t = first_tile; t < last_tile; t++) {
+        ranking[t].resize(components_size);
+        stream.read((char*) ranking[t].data(), (size_t) components_size * sizeof(mosaic_map));
+        if (!stream)
+            return 0;
+        for (int n = 0; n < components_size; n++)
+            if (ranking[t][n].index >= (uint32_t) components_size)
+                return 0;
     }
-    else {
-        string output = "ERROR: Cannot open component directory";
-        dbgprint(1, output);
+
+    tile_map.swap(ranking);
+#endif
+    return 1;
+#endif
+}
+
+// saves the rankings of every shard tile to FILE_RANK, before fitting moves any of them on
+// returns 0 for success, 1 for failure
+int rank_cache_save(unsigned long long layout_hash)
+{
+#if RANK_MODE == 1
+    return 0;
+#else
+    if (FILE_RANK.empty())
+        return 0;
+
+    // written aside and renamed like the fit cache
+    string temp_name = FILE_RANK + ".tmp" + to_string(getpid());
+    {
+        ofstream stream(temp_name.c_str(), ios::binary);
+        if (!stream) {
+            dbgprint(1, "ERROR: Cannot write rank cache " + FILE_RANK);
+            return 1;
+        }
+
+        stream.write(RANK_CACHE_MAGIC, sizeof(RANK_CACHE_MAGIC));
+        stream.write((const char*) &layout_hash, sizeof(layout_hash));
+        stream.write((const char*) &mosaic.rows, sizeof(mosaic.rows));
+        stream.write((const char*) &mosaic.cols, sizeof(mosaic.cols));
+        int first_tile = shard_row_begin * mosaic.cols;
+        int last_tile = shard_row_end * mosaic.cols;
+#if RANK_MODE == 2
+        stream.write((const char*) &tile_top_k[(size_t) first_tile * RANK_TOP_K],
+                     (size_t) (last_tile - first_tile) * RANK_TOP_K * sizeof(mosaic_map));
+#else
+        for (int t = first_tile; t < last_tile; t++)
+            stream.write((const char*) tile_map[t].data(), (size_t) components_size * sizeof(mosaic_map));
+#endif
+        if (!stream) {
+            dbgprint(1, "ERROR: Cannot write rank cache " + FILE_RANK);
+            stream.close();
+            unlink(temp_name.c_str());
+            return 1;
+        }
+    }
+
+    return rename(temp_name.c_str(), FILE_RANK.c_str()) != 0;
+#endif
+}
+
+
+/***********************************************/
+/*************** INPUT FUNCTIONS ***************/
+/***********************************************/
+// RMS weight of a cropped component
+// pixels: BGR pixels back to back, as stored in the tile cache
+// count: number of pixels
+rgb_t component_weigh(const unsigned char* pixels, size_t count)
+{
+    // exact integer sums, a single pass the compiler can vectorize
+    unsigned long long r = 0, g = 0, b = 0;
+#pragma omp simd reduction(+:r, g, b)
+    for (size_t n = 0; n < count; n++) {
+        unsigned int blue = pixels[n * 3], green = pixels[n * 3 + 1], red = pixels[n * 3 + 2];
+        b += blue * blue;
+        g += green * green;
+        r += red * red;
     }
+
+    rgb_t weight;
+    weight.red = count ? sqrt((double) r / count) : 0;
+    weight.green = count ? sqrt((double) g / count) : 0;
+    weight.blue = count ? sqrt((double) b / count) : 0;
+    return weight;
+}
+
+// decodes every component into the tile cache and calculates its RMS weight
+// removes components from the list along with their tile cache slots
+// later components move down so image indexes stay dense, must be called before ranking
+// failed: 1 for every component to remove
+void component_drop(const vector<char>& failed)
+{
+    int kept = 0;
+    vector <char> loaded;
+    for (int img = 0; img < components_size; img++) {
+        if (failed[img])
+            continue;
+        if (kept != img) {
+            components[kept] = move(components[img]);
+            component_rgb[kept] = component_rgb[img];
+            memmove(tile_cache_get(kept), tile_cache_get(img), tile_cache_stride);
+        }
+        loaded.push_back(tile_cache_loaded[img].load());
+        kept++;
+    }
+
+    components.resize(kept);
+    component_rgb.resize(kept);
+    component_placed.assign(kept, 0);
+    tile_cache.resize(tile_cache_stride * kept);
+    tile_cache_loaded = vector<atomic<char>>(kept);
+    for (int img = 0; img < kept; img++)
+        tile_cache_loaded[img].store(loaded[img]);
+    components_size = kept;
+}
+
+// only the cropped cmp_width x cmp_height portion is weighed
+// returns number of component images weighed
+int get_component_file_weight()
+{
+    trace_scope scope("cmp_weights");
+    tile_cache_init();
+
+    // weights in the index are only valid for the crop size they were taken at
+    if (component_index_width != mosaic.cmp_width || component_index_height != mosaic.cmp_height) {
+        for (int img = 0; img < components_size; img++)
+            components[img].weighed = 0;
+        component_index_dirty = 1;
+    }
+    // every weight is for this crop once we are done
+    component_index_width = mosaic.cmp_width;
+    component_index_height = mosaic.cmp_height;
+
+    // unchanged since the last run, reuse the indexed weight
+    vector <int> stale;
+    for (int img = 0; img < components_size; img++)
+        if (!components[img].weighed)
+            stale.push_back(img);
+
+    // the loader threads keep reading the next files while the workers weigh the ones already read
+    bounded_queue <decoded_component> decoded(IO_QUEUE_DEPTH);
+    tile_loader_start(stale, &decoded);
+
+    // every worker takes whole images off the queue, so a slow file only holds up one thread
+    int weighed = 0;
+    int failures = 0;
+    vector <char> failed(components_size, 0);
+#pragma omp parallel num_threads(numthreads) reduction(+:weighed, failures)
+    {
+        decoded_component item;
+        while (decoded.pop(item)) {
+            int img = item.img_index;
+            dbglog(2, "Weighing File: %s", components[img].path.c_str());
+            trace_begin("weigh");
+
+            // each file is read from disk exactly once, write_full_img() reuses the crop
+            int store_failed = tile_cache_store(img, *item.image);
+            item.image.reset();
+
+            if (store_failed) {
+                failed[img] = 1;
+                failures++;
+            }
+            else {
+                component_rgb[img] = component_weigh(tile_cache_get(img), (size_t) mosaic.cmp_width * mosaic.cmp_height);
+                components[img].weighed = 1;
+                weighed++;
+            }
+            trace_end();
+        }
+    }
+    tile_loader_join();
+
+    // an unreadable image would be weighed and drawn as a black tile, it is left out of the list
+    // (and so out of the index) and probed again the next time the library is listed
+    int total = components_size;
+    if (failures > 0) {
+        component_drop(failed);
+        component_index_dirty = 1;
+    }
+
+    if (weighed > 0)
+        component_index_dirty = 1;
+    if (component_index_dirty)
+        component_index_save();
+
     string output = "Done finding weight for " + to_string(components_size) + " component images";
+    output += " (" + to_string(weighed) + " weighed, " + to_string(total - weighed - failures) + " from index";
+    if (failures > 0)
+        output += ", " + to_string(failures) + " unreadable and left out";
+    output += ")";
     dbgprint(1, output);
     return components_size;
 }
@@ -544,10 +3138,21 @@ int get_component_file_weight()
 // returns number of component images found
 int get_component_file_list()
 {
+    trace_scope scope("index");
     struct dirent **files;
+    int indexed = 0;
+
+    // a batch job can point at a different library, start over
+    components.clear();
+    component_rgb.clear();
+    cmp_img_min_width = cmp_img_min_height = UINT_MAX;
+    tile_cache_stride = 0;
+    components_dir = DIR_IMG_PATH;
+
+    component_index_load();
 
     // Scan files in directory
-    int n = scandir(DIR_IMG_PATH, &files, NULL, alphasort);
+    int n = scandir(DIR_IMG_PATH.c_str(), &files, NULL, alphasort);
     if (n >= 0) {
         // Loop through file names
         for (int i = 0; i < n; i++) {
@@ -564,24 +3169,44 @@ int get_component_file_list()
                     fullpath += "/";
                     fullpath += ent->d_name;
 
-                    string output = "Loading File: " + fullpath;
-                    dbgprint(2, output);
+                    dbglog(2, "Loading File: %s", fullpath.c_str());
 
-                    bitmap_image image(fullpath);
-
-                    // save this component image
                     component_metadata tmp;
-                    tmp.width = image.width();
-                    tmp.height = image.height();
                     tmp.path = fullpath;
+                    rgb_t rgb = { 0, 0, 0 };
 
-                    tmp.rgb.red = 0;
-                    tmp.rgb.green = 0;
-                    tmp.rgb.blue = 0;
-                    tmp.placed = 0;
+                    struct stat st;
+                    if (stat(fullpath.c_str(), &st) == 0) {
+                        tmp.mtime = (long long) st.st_mtime;
+                        tmp.size = (long long) st.st_size;
+                    }
+
+                    // unchanged files come straight from the index
+                    unordered_map <string, component_index_entry>::const_iterator entry = component_index.find(fullpath);
+                    if (entry != component_index.end() && entry->second.mtime == tmp.mtime && entry->second.size == tmp.size) {
+                        tmp.width = entry->second.width;
+                        tmp.height = entry->second.height;
+                        rgb = entry->second.rgb;
+                        tmp.weighed = entry->second.weighed;
+                        indexed++;
+                    }
+                    else {
+                        // only the header is needed here, pixels are decoded once by the tile cache
+                        bitmap_image image;
+                        if (!image.read_header(fullpath)) {
+                            dbgprint(1, "Skipping invalid BMP: " + fullpath);
+                            break;
+                        }
+
+                        tmp.width = image.width();
+                        tmp.height = image.height();
+                        tmp.weighed = 0;
+                        component_index_dirty = 1;
+                    }
 
                     // save component image
                     components.push_back(tmp);
+                    component_rgb.push_back(rgb);
 
                     // save image set minimum width and height
                     if (tmp.width < cmp_img_min_width)
@@ -603,35 +3228,169 @@ int get_component_file_list()
         string output = "ERROR: Cannot open component directory";
         dbgprint(1, output);
     }
+    // removed files also invalidate the index on disk
+    if (indexed != (int) component_index.size())
+        component_index_dirty = 1;
+
+    component_placed.assign(components.size(), 0);
+
     string output = "Done loading " + to_string(components.size()) + " component images" ;
+    output += " (" + to_string(indexed) + " from index)";
     dbgprint(1, output);
     return components.size();
 }
 
+// builds summed area tables of the squared channels of the reference image
+// image: reference image
+// pass 1 runs prefix sums along every row, pass 2 along every column, both in parallel
+void ref_sat_build(const bitmap_image& image)
+{
+    ref_sat_width = image.width();
+    ref_sat_height = image.height();
+    size_t stride = ((size_t) ref_sat_width + 1) * 3;
+    ref_sat.assign(stride * (ref_sat_height + 1), 0);
+
+    pool_for(ref_sat_height, [&](int y) {
+        const unsigned char* bgr = image.row(y);
+        unsigned long long* sat = &ref_sat[stride * (y + 1) + 3];
+        unsigned long long r = 0, g = 0, b = 0;
+        for (unsigned int x = 0; x < ref_sat_width; x++, bgr += 3, sat += 3) {
+            r += bgr[2] * bgr[2];
+            g += bgr[1] * bgr[1];
+            b += bgr[0] * bgr[0];
+            sat[0] = r;
+            sat[1] = g;
+            sat[2] = b;
+        }
+    });
+
+    // columns are summed in blocks so every thread still reads whole cache lines
+    const int block = 64 * 3;
+    pool_for(((int) stride + block - 1) / block, [&](int n) {
+        int x0 = n * block;
+        int x1 = min_n(x0 + block, (int) stride);
+        for (unsigned int y = 1; y <= ref_sat_height; y++) {
+            unsigned long long* sat = &ref_sat[stride * y];
+            const unsigned long long* above = sat - stride;
+            for (int x = x0; x < x1; x++)
+                sat[x] += above[x];
+        }
+    });
+}
+
+// sums a squared channel over [x0, x1) x [y0, y1) of the reference image
+// channel: 0 red, 1 green, 2 blue
+inline unsigned long long ref_sat_sum(int channel, size_t x0, size_t y0, size_t x1, size_t y1)
+{
+    size_t stride = ((size_t) ref_sat_width + 1) * 3;
+    return ref_sat[y1 * stride + x1 * 3 + channel] - ref_sat[y0 * stride + x1 * 3 + channel]
+         - ref_sat[y1 * stride + x0 * 3 + channel] + ref_sat[y0 * stride + x0 * 3 + channel];
+}
+
+// calculates the rgb weight of every tile from the summed area tables
+// every tile costs four lookups per channel, so re-tiling does not touch the reference again
+// must be called after ref_sat_build() and once mosaic rows, cols and tile size are set
+void get_mosaic_weights()
+{
+    size_t w = ref_sat_width;
+    size_t h = ref_sat_height;
+
+    // dont track the edges if the aspect ratio isnt exact
+    // using tricky integer rounding to get the exact pixels we want
+    size_t h_step = h / mosaic.rows;
+    size_t w_step = w / mosaic.cols;
+    size_t h_scaled = h_step * mosaic.rows;
+    size_t w_scaled = w_step * mosaic.cols;
+
+    tile_rgb.resize((size_t) mosaic.rows * mosaic.cols);
+    tile_img.assign((size_t) mosaic.rows * mosaic.cols, -1);
+
+    pool_for(mosaic.rows, [&](int y_count) {
+        for (int x_count = 0; x_count < mosaic.cols; x_count++) {
+            rgb_t& tmp = tile_rgb[(size_t) y_count * mosaic.cols + x_count];
+
+            // check the rgb weight for this tile region
+            size_t y0 = y_count * h_step;
+            size_t x0 = x_count * w_step;
+            size_t y1 = min(y0 + mosaic.cmp_height, h_scaled);
+            size_t x1 = min(x0 + mosaic.cmp_width, w_scaled);
+            float count = (float) ((y1 - y0) * (x1 - x0));
+
+            // average rgb weight for this tile
+            tmp.red = sqrt(ref_sat_sum(0, x0, y0, x1, y1) / count);
+            tmp.green = sqrt(ref_sat_sum(1, x0, y0, x1, y1) / count);
+            tmp.blue = sqrt(ref_sat_sum(2, x0, y0, x1, y1) / count);
+        }
+    });
+}
+
+// chooses rows, cols and the tile crop for a target tile count (TILE_COUNT)
+// cols / rows follows the reference aspect ratio divided by the native component aspect
+// ratio, so only the sliver that makes rows and cols whole numbers is cropped off the tiles
+// w, h: reference size
+// count: wanted number of tiles, the grid gets as close to it as whole rows and cols allow
+// returns 0 for success, 1 for failure
+int get_mosaic_grid(unsigned int w, unsigned int h, int count)
+{
+    double ref_aspect_ratio = (double) w / h;
+    double cmp_aspect_ratio = (double) cmp_img_min_width / cmp_img_min_height;
+    double grid_ratio = ref_aspect_ratio / cmp_aspect_ratio;
+
+    mosaic.rows = max_n((int) lround(sqrt(count / grid_ratio)), 1);
+    mosaic.cols = max_n((int) lround((double) count / mosaic.rows), 1);
+
+    // tile shape that makes the mosaic exactly as wide as the reference for its height
+    double tile_aspect_ratio = ref_aspect_ratio * mosaic.rows / mosaic.cols;
+    if (tile_aspect_ratio < cmp_aspect_ratio) {
+        dbgprint(1, "Cropping Mosaic Width");
+        mosaic.cmp_height = cmp_img_min_height;
+        mosaic.cmp_width = (unsigned int) lround(cmp_img_min_height * tile_aspect_ratio);
+    }
+    else {
+        dbgprint(1, "Cropping Mosaic Height");
+        mosaic.cmp_width = cmp_img_min_width;
+        mosaic.cmp_height = (unsigned int) lround(cmp_img_min_width / tile_aspect_ratio);
+    }
+
+    if (mosaic.cmp_width < 1 || mosaic.cmp_height < 1) {
+        dbgprint(0, "ERROR: TILE_COUNT gives tiles under one pixel for this reference");
+        return 1;
+    }
+    return 0;
+}
+
 // gets mosaic metadata
 // returns 0 for success, 1 for failure
 int get_mosaic_metadata(int num_tiles)
 {
+    trace_scope scope("ref_weights");
     string file_name(FILE_REF);
-    bitmap_image image(file_name);
+    // ref_sat_build() reads every row once, straight out of the mapping
+    bitmap_image image(file_name, bitmap_image::mapped_mode);
 
     if (!image) {
         dbgprint(0, "ERROR: FILE_REF not found");
+        return 1;
     }
 
     unsigned int w = image.width();
     unsigned int h = image.height();
     mosaic.total = num_tiles;
 
-    // determine desired tile pixel size
-    // maintain pixel ratio to our reference image
-    // all images will be the same size, large images are cropped
-    float ref_aspect_ratio = (float) w / (float) h;
-    float cmp_aspect_ratio = (float) cmp_img_min_width / (float) cmp_img_min_height;
-    // crop the height
-    if (cmp_aspect_ratio < ref_aspect_ratio) {
-        dbgprint(1, "Cropping Mosaic Height");
-        // reduce pixels until we get within error margin
+    if (TILE_COUNT > 0) {
+        if (get_mosaic_grid(w, h, TILE_COUNT))
+            return 1;
+    }
+    else {
+        // determine desired tile pixel size
+        // maintain pixel ratio to our reference image
+        // all images will be the same size, large images are cropped
+        float ref_aspect_ratio = (float) w / (float) h;
+        float cmp_aspect_ratio = (float) cmp_img_min_width / (float) cmp_img_min_height;
+        // crop the height
+        if (cmp_aspect_ratio < ref_aspect_ratio) {
+            dbgprint(1, "Cropping Mosaic Height");
+            // reduce pixels until we get within error margin
 //        for (int new_height = cmp_img_min_height; new_height > 0; new_height--) {
 //            float ratio_err = abs(ref_aspect_ratio - (float) cmp_img_min_width / (float) new_height);
 //
@@ -647,19 +3406,19 @@ int get_mosaic_metadata(int num_tiles)
 //            }
 //        }
 
-        int new_height = (int) ((float)cmp_img_min_width / (ASP_RATIO_ERR + ref_aspect_ratio));
-        mosaic.cmp_height = new_height;
-        mosaic.cmp_width = cmp_img_min_width;
-        if (new_height <= 20) {
-            dbgprint(0, "ERROR: Cropped height value too low, increase ASP_RATIO_ERR to use this image");
-            return 1;
+            int new_height = (int) ((float)cmp_img_min_width / (ASP_RATIO_ERR + ref_aspect_ratio));
+            mosaic.cmp_height = new_height;
+            mosaic.cmp_width = cmp_img_min_width;
+            if (new_height <= 20) {
+                dbgprint(0, "ERROR: Cropped height value too low, increase ASP_RATIO_ERR to use this image");
+                return 1;
+            }
+
         }
-
-    }
-        // crop the width
-    else {
-        dbgprint(1, "Cropping Mosaic Width");
-        // reduce pixels until we get within error margin
+            // crop the width
+        else {
+            dbgprint(1, "Cropping Mosaic Width");
+            // reduce pixels until we get within error margin
 //        for (int new_width = cmp_img_min_width; new_width > 0; new_width--) {
 //            float ratio_err = abs(ref_aspect_ratio - (float) new_width / (float) cmp_img_min_height);
 //            if (ratio_err <= ASP_RATIO_ERR) {
@@ -673,120 +3432,46 @@ int get_mosaic_metadata(int num_tiles)
 //                return 1;
 //            }
 //        }
-        int new_width = (int)((float)cmp_img_min_height * (ref_aspect_ratio + ASP_RATIO_ERR));
-        mosaic.cmp_width = new_width;
-        mosaic.cmp_height = cmp_img_min_height;
-        if (new_width <= 20) {
-            dbgprint(0, "ERROR: Cropped height value too low");
-            return 1;
-        }
+            int new_width = (int)((float)cmp_img_min_height * (ref_aspect_ratio + ASP_RATIO_ERR));
+            mosaic.cmp_width = new_width;
+            mosaic.cmp_height = cmp_img_min_height;
+            if (new_width <= 20) {
+                dbgprint(0, "ERROR: Cropped height value too low");
+                return 1;
+            }
 
 
-    }
+        }
 
-    // determine number of images on a row and in a col
-    // look for the closest aspect ratio
-    /*dbgprint(1, "Saving Mosaic Rows + Cols");
-    mosaic.rows = mosaic.cols = 1;
-    cmp_aspect_ratio = (float)mosaic.cmp_width / (float)mosaic.cmp_height;
-    while ((mosaic.rows+1) * (mosaic.cols+1) <= mosaic.total) {
-      mosaic.rows += 1;
-      mosaic.cols += 1;
-    }*/
-    // this should work for squares
-    mosaic.rows = mosaic.cols = TILE_LDA;
+        // determine number of images on a row and in a col
+        // look for the closest aspect ratio
+        /*dbgprint(1, "Saving Mosaic Rows + Cols");
+        mosaic.rows = mosaic.cols = 1;
+        cmp_aspect_ratio = (float)mosaic.cmp_width / (float)mosaic.cmp_height;
+        while ((mosaic.rows+1) * (mosaic.cols+1) <= mosaic.total) {
+          mosaic.rows += 1;
+          mosaic.cols += 1;
+        }*/
+        // this should work for squares
+        mosaic.rows = mosaic.cols = TILE_LDA;
+    }
 
     // mosaic resolution
     dbgprint(1, "Saving Mosaic Dimensions");
     mosaic.width = mosaic.cmp_width * mosaic.cols;
     mosaic.height = mosaic.cmp_height * mosaic.rows;
 
-    int y_count = 0;
-    int x_count = 0;
-
-    // dont track the edges if the aspect ratio isnt exact
-    // using tricky integer rounding to get the exact pixels we want
-    int h_scaled = h / mosaic.rows;
-    int w_scaled = w / mosaic.cols;
-    h_scaled *= mosaic.rows;
-    w_scaled *= mosaic.cols;
+    // the grid decides the real number of tiles
+    mosaic.total = TOTAL_TILES = mosaic.rows * mosaic.cols;
+    // shard_plan() narrows this down to a band
+    shard_row_begin = 0;
+    shard_row_end = mosaic.rows;
 
     // calculate the rgb weight for every tile
     // if the aspect ratio is off some pixels will get trimmed from the calculations
     dbgprint(1, "Calculating Mosaic Weights");
-    for (size_t y = 0; y < h_scaled; y += h / mosaic.rows) {
-        for (size_t x = 0; x < w_scaled; x += w / mosaic.cols) {
-//            mosaic_tile tmp;
-//            tmp.start_y = y_count * mosaic.cmp_height;
-//            tmp.start_x = x_count * mosaic.cmp_width;
-//
-//            omp_set_num_threads(numthreads);
-//            float total_r = 0, total_g = 0, total_b = 0;
-//            int total_count = 0;
-//            #pragma omp parallel
-//            {
-//                int id, nthrds;
-//                id = omp_get_thread_num();
-//                nthrds = omp_get_num_threads();
-//                rgb_t rgb;
-//                float r = 0, g = 0, b = 0, count = 0;
-//                // check the rgb weight for this tile region
-//                for (size_t j = y + id; j < y + mosaic.cmp_height && j < h_scaled; j=j+nthrds)
-//                    for (size_t i = x; i < x + mosaic.cmp_width && i < w_scaled; i++) {
-//                        image.get_pixel(i, j, rgb);
-//                        r += rgb.red * rgb.red;
-//                        g += rgb.green * rgb.green;
-//                        b += rgb.blue * rgb.blue;
-//                        count++;
-//                    }
-//            #pragma omp critical
-//                total_count += count;
-//                total_r += r;
-//                total_g += g;
-//                total_b += b;
-//
-//            }
-//            // average rgb weight for this tile
-//            total_r = sqrt(total_r / total_count);
-//            total_g = sqrt(total_g / total_count);
-//            total_b = sqrt(total_b / total_count);
-//            tmp.rgb.red = total_r;
-//            tmp.rgb.green = total_g;
-//            tmp.rgb.blue = total_b;
-//            tmp.img_index = -1;	// no index
-
-            mosaic_tile tmp;
-            rgb_t rgb;
-            float r = 0, g = 0, b = 0, count = 0;
-            tmp.start_y = y_count * mosaic.cmp_height;
-            tmp.start_x = x_count * mosaic.cmp_width;
-
-            // check the rgb weight for this tile region
-            for (size_t j = y; j < y + mosaic.cmp_height && j < h_scaled; j++)
-                for (size_t i = x; i < x + mosaic.cmp_width && i < w_scaled; i++) {
-                    image.get_pixel(i, j, rgb);
-                    r += rgb.red * rgb.red;
-                    g += rgb.green * rgb.green;
-                    b += rgb.blue * rgb.blue;
-                    count++;
-                }
-
-            // average rgb weight for this tile
-            r = sqrt(r / count);
-            g = sqrt(g / count);
-            b = sqrt(b / count);
-            tmp.rgb.red = r;
-            tmp.rgb.green = g;
-            tmp.rgb.blue = b;
-            tmp.img_index = -1;	// no index
-
-            tiles.push_back(tmp);
-
-            x_count++;
-        }
-        y_count++;
-        x_count = 0;
-    }
+    ref_sat_build(image);
+    get_mosaic_weights();
 
     string output = "Done loading metadata";
     output += "\n\tMetadata Summary:";
@@ -800,11 +3485,209 @@ int get_mosaic_metadata(int num_tiles)
 
 
 
-/************************************/
-/*************** MAIN ***************/
-/************************************/
+/***********************************************/
+/*************** SHARD FUNCTIONS ***************/
+/***********************************************/
+
+// name of a shard's band file, FILE_OUT with _shard<n> before the extension
+string shard_file_name(int shard)
+{
+    string suffix = "_shard" + to_string(shard);
+    size_t dot = FILE_OUT.rfind('.');
+    if (dot == string::npos || FILE_OUT.find('/', dot) != string::npos)
+        return FILE_OUT + suffix;
+    return FILE_OUT.substr(0, dot) + suffix + FILE_OUT.substr(dot);
+}
+
+// picks the tile rows of SHARD_INDEX out of SHARD_COUNT even bands
+// every shard works the grid out from the same reference, so they all agree on the bands
+// must be called after get_mosaic_metadata()
+// returns 0 for success, 1 for failure
+int shard_plan()
+{
+    if (SHARD_COUNT <= 1)
+        return 0;
+
+    if (SHARD_INDEX < 0 || SHARD_INDEX >= SHARD_COUNT) {
+        dbgprint(0, "ERROR: shard must be between 0 and shards - 1");
+        return 1;
+    }
+    // a band needs room for both halos, or tiles two bands apart could see each other
+    if (mosaic.rows / SHARD_COUNT < max_n(2 * TILE_MIN_DIST, 1)) {
+        dbgprint(0, "ERROR: Too many shards, every band needs at least 2 * TILE_MIN_DIST tile rows");
+        return 1;
+    }
+    if (TILE_RPT_COUNT < SHARD_COUNT)
+        dbgprint(1, "Warning: TILE_RPT_COUNT is below the shard count, some components are left out of some shards");
+
+    shard_row_begin = (int) ((long long) mosaic.rows * SHARD_INDEX / SHARD_COUNT);
+    shard_row_end = (int) ((long long) mosaic.rows * (SHARD_INDEX + 1) / SHARD_COUNT);
+
+    string output = "\nRendering shard " + to_string(SHARD_INDEX) + " of " + to_string(SHARD_COUNT);
+    output += " (tile rows " + to_string(shard_row_begin) + " to " + to_string(shard_row_end - 1) + ") to " + shard_file_name(SHARD_INDEX);
+    dbgprint(1, output);
+    return 0;
+}
+
+// joins the SHARD_COUNT band files into FILE_OUT without decoding them
+// the bands share the same width and scanline padding, so the pixels of a BMP are just the
+// bands' pixels back to back, bottom band first
+// returns 0 for success, 1 for failure
+int merge_shards()
+{
+    if (png_file_name(FILE_OUT)) {
+        dbgprint(0, "ERROR: Shards are merged as BMP, FILE_OUT must be a .bmp");
+        return 1;
+    }
+
+    unsigned int width = 0, height = 0;
+    for (int shard = 0; shard < SHARD_COUNT; shard++) {
+        bitmap_image band;
+        if (!band.read_header(shard_file_name(shard))) {
+            dbgprint(0, "ERROR: Cannot read shard " + shard_file_name(shard));
+            return 1;
+        }
+        if (shard > 0 && band.width() != width) {
+            dbgprint(0, "ERROR: Shard " + shard_file_name(shard) + " is not as wide as the others");
+            return 1;
+        }
+        width = band.width();
+        height += band.height();
+    }
+
+    ofstream stream(FILE_OUT.c_str(), ios::binary);
+    if (!stream) {
+        dbgprint(0, "ERROR: Cannot open FILE_OUT for writing");
+        return 1;
+    }
+    bitmap_image().save_header(stream, width, height);
+    size_t header_bytes = (size_t) stream.tellp();
+
+    // read_header() checked the pixels follow the headers directly
+    vector <char> buffer(1 << 20);
+    for (int shard = SHARD_COUNT - 1; shard >= 0; shard--) {
+        ifstream band(shard_file_name(shard).c_str(), ios::binary);
+        band.seekg(header_bytes);
+        while (band.read(buffer.data(), buffer.size()) || band.gcount() > 0)
+            stream.write(buffer.data(), band.gcount());
+    }
+
+    stream.close();
+    if (!stream) {
+        dbgprint(0, "ERROR: Cannot write FILE_OUT");
+        return 1;
+    }
+
+    string output = "Merged " + to_string(SHARD_COUNT) + " shards into " + FILE_OUT;
+    output += " (" + to_string(width) + " x " + to_string(height) + ")";
+    dbgprint(1, output);
+    return 0;
+}
+
+
+/************************************************/
+/*************** RENDER FUNCTIONS ***************/
+/************************************************/
+
+// ranks every tile against the components the way RANK_MODE asks for
+// must be called after get_component_file_weight()
+void rank_all_tiles()
+{
+    trace_scope scope("rank");
+    build_component_colors();
+#if RANK_MODE == 1
+    // candidates are pulled from the tree while fitting, nothing is ranked up front
+    kd_build();
+#elif RANK_MODE == 2
+    // one flat T * K array, tiles that run out rank their next batch while fitting
+    tile_top_k.resize((size_t) TOTAL_TILES * RANK_TOP_K);
+    tile_top_k_base.assign(TOTAL_TILES, 0);
+#if GPU_OFFLOAD
+    gpu_rank_top_k();
+#else
+    pool_for(shard_row_end - shard_row_begin, [&](int n) {
+        int row = shard_row_begin + n;
+        trace_begin("rank");
+        for (int i = row * mosaic.cols; i < (row + 1) * mosaic.cols; i++)
+            tile_rank_top_k(i, 0);
+        trace_end();
+    });
+#endif
+#else
+    // set our size or we run into allocation errors
+    tile_map.resize(TOTAL_TILES);
+    // rank tiles
+    // (significant performance bottle neck here)
+    pool_for(shard_row_end - shard_row_begin, [&](int n) {
+        int row = shard_row_begin + n;
+        trace_begin("rank");
+        for (int i = row * mosaic.cols; i < (row + 1) * mosaic.cols; i++)
+            tile_rank_fits(i);
+        trace_end();
+    });
+#endif
+}
+
+// forgets every placement so the tiles can be fitted again
+void fit_reset()
+{
+    for (int img = 0; img < components_size; img++)
+        component_placed[img] = 0;
+    fill(tile_img.begin(), tile_img.end(), -1);
+}
+
+// fits every tile with the FIT_MODE engine
+void fit_tiles()
+{
+    trace_scope scope("fit");
+#if FIT_MODE == 1
+    // the auction prices every component over the whole grid, a shard fits its band greedily
+    if (SHARD_COUNT > 1)
+        fit_all_tiles();
+    else
+        fit_auction_tiles();
+#else
+    fit_all_tiles();
+#endif
+}
+
+// writes FILE_OUT with the WRITE_MODE writer
+// WRITE_MODE 0 needs write_bmp_template() first
+void write_mosaic()
+{
+    trace_scope scope("write");
+    // a shard streams its band to its own file whatever the WRITE_MODE, merge_shards() joins them
+    if (SHARD_COUNT > 1) {
+        write_stream_img(shard_file_name(SHARD_INDEX));
+        return;
+    }
+
+#if PNG_OUTPUT
+    // deflated strips instead of raw scanlines, whatever the WRITE_MODE
+    if (png_file_name(FILE_OUT)) {
+        write_png_img();
+        return;
+    }
+#endif
+
+    // place tiles
+    // writing full image uses more memory but is significantly faster
+    // (bottle neck with FILTER == 1)
+#if WRITE_MODE == 1
+    // streaming skips the template round trip, peak memory is one tile row strip per thread
+    write_stream_img();
+#elif WRITE_MODE == 2
+    // tiles are drawn straight into the mapped file, no canvas is loaded or saved
+    write_mapped_img();
+#else
+    write_full_img();
+#endif
+}
 
-int main()
+// renders one mosaic from the current settings
+// the component list, index and tile cache are kept for the next call (batch mode)
+// returns 0 for success, 1 for failure
+int render_mosaic()
 {
     int check = 1;
 
@@ -812,18 +3695,32 @@ int main()
 
     double program_time = read_timer();
     double time_step = read_timer();
+    trace_reset();
+
+    // shard bands stay BMP so merge_shards() can join them without decoding
+    if (png_file_name(FILE_OUT) && (!PNG_OUTPUT || SHARD_COUNT > 1)) {
+        dbgprint(0, PNG_OUTPUT ? "ERROR: Shards are merged as BMP, FILE_OUT must be a .bmp" : "ERROR: PNG output needs zlib (PNG_OUTPUT 1)");
+        return 1;
+    }
 
     // Load component images and:
     // 1) calculate RGB weights
     // 2) save metadata (filename, width, height)
     // (very slight bottle neck)
-    dbgprint(1, "Starting Image Indexing");
-    components_size = get_component_file_list();
-    if (TIMESTEPS) {
-        printf("Time taken  [%g seconds]", read_timer() - time_step);
-        time_step = read_timer();
+    // a batch only pays for this once per library
+    if (components_dir != DIR_IMG_PATH) {
+        dbgprint(1, "Starting Image Indexing");
+        components_size = get_component_file_list();
+        if (TIMESTEPS) {
+            printf("Time taken  [%g seconds]", read_timer() - time_step);
+            time_step = read_timer();
+        }
     }
 
+    // placements belong to the last job, its ranking is kept in case the tiles are the same
+    TOTAL_TILES = TILE_COUNT > 0 ? TILE_COUNT : TILE_LDA * TILE_LDA;
+    fit_reset();
+
     // Load the reference file and subdivide it into regions
     // for each region calculate the weight
     // (performance bottle neck here)
@@ -833,6 +3730,8 @@ int main()
         printf("Time taken  [%g seconds]", read_timer() - time_step);
         time_step = read_timer();
     }
+    // without a crop size there is nothing to weigh
+    if (check || shard_plan())	return 1;
 
     // should calculate weight on the portion we crop and not the entire tile image
     dbgprint(1, "\n\nStarting Image Weight Calculations");
@@ -842,86 +3741,614 @@ int main()
         time_step = read_timer();
     }
 
-    if (check)	return 0;
+#if WRITE_MODE == 0 || TEST
     // create a blank template
     // (no bottle neck here)
-    write_bmp_template();
-    if (TIMESTEPS) {
-        printf("Time taken  [%g seconds]", read_timer() - time_step);
-        time_step = read_timer();
-    }
-
-    dbgprint(1, "\n\nStarting Ranking");
-    // set our size or we run into allocation errors
-    tile_map.resize(TOTAL_TILES);
-    // rank tiles
-    // (significant performance bottle neck here)
-#pragma omp parallel for num_threads(numthreads)
-    for (int i = 0; i < TOTAL_TILES; i++)
-        tile_rank_fits(i);
-    dbgprint(1, "Done Ranking");
+    // shards stream their band instead (see write_mosaic())
+    if ((SHARD_COUNT <= 1 && !png_file_name(FILE_OUT)) || TEST)
+        write_bmp_template();
     if (TIMESTEPS) {
         printf("Time taken  [%g seconds]", read_timer() - time_step);
         time_step = read_timer();
     }
+#endif
 
-    dbgprint(1, "\n\nStarting Fitting");
-    // find the best fit for all tiles
-    // (significant performance bottle neck here)
-    //TILE_MIN_DIST
-    //int r = tile_index / mosaic.cols + row;
-    //int c = tile_index % mosaic.cols + col;
-    //int loc = r * mosaic.cols + c;
-    //cout<<TOTAL_TILES<<endl;
-    omp_set_num_threads(numthreads);
-    #pragma omp parallel
-    {
-        int id = omp_get_thread_num();
-        int nthrds = omp_get_num_threads();
-//        for (int row = id * 2 * TILE_MIN_DIST; row < mosaic.rows; row=row+nthrds*2*TILE_MIN_DIST) {
-//           for (int i = row; i < min(row + 2 * TILE_MIN_DIST, mosaic.rows); i++) {
-//               for (int j = 0; j < mosaic.cols; j++) {
-//                   int index = i * mosaic.cols + j;
-//                   //cout<<index<<endl;
-//                   tile_place_best_fit(index);
-//               }
-//           }
-//        }
-
-        for (int col = id * 2 * TILE_MIN_DIST;  col< mosaic.rows; col=col+nthrds*2*TILE_MIN_DIST) {
-            for (int j = col; j < min(col + 2 * TILE_MIN_DIST, mosaic.cols); j++) {
-                for (int i = 0; i < mosaic.rows; i++) {
-                    int index = i * mosaic.cols + j;
-                    tile_place_best_fit(index);
-                }
-            }
+    // rank and fit results only depend on the colors and the fit settings,
+    // a run that only changes how tiles are drawn goes straight to writing
+    unsigned long long layout_hash = fit_cache_layout_hash();
+    unsigned long long fit_hash = fit_cache_fit_hash(layout_hash);
+    if (fit_cache_load(fit_hash))
+        dbgprint(1, "\n\nReusing ranking and fitting from " + FILE_FIT);
+    else {
+        dbgprint(1, "\n\nStarting Ranking");
+        // a batch job or run that only changes TILE_RPT_COUNT or TILE_MIN_DIST fits against the last ranking
+        if (layout_hash != rank_hash && rank_cache_load(layout_hash)) {
+            build_component_colors();
+            rank_hash = layout_hash;
+            dbgprint(1, "Reusing ranking from " + FILE_RANK);
+        }
+        else if (layout_hash != rank_hash) {
+            rank_all_tiles();
+            rank_cache_save(layout_hash);
+            rank_hash = layout_hash;
+            dbgprint(1, "Done Ranking");
+        }
+        else
+            dbgprint(1, "Reusing ranking of the last job");
+        if (TIMESTEPS) {
+            printf("Time taken  [%g seconds]", read_timer() - time_step);
+            time_step = read_timer();
         }
 
+        dbgprint(1, "\n\nStarting Fitting");
+        // find the best fit for all tiles
+        // (significant performance bottle neck here)
+        fit_tiles();
+        fit_cache_save(fit_hash);
+        dbgprint(1, "Done Fitting");
     }
-//    for (int i = 0; i < TOTAL_TILES; i++)
-//        tile_place_best_fit(i);
-    dbgprint(1, "Done Fitting");
     if (TIMESTEPS) {
         printf("Time taken  [%g seconds]", read_timer() - time_step);
         time_step = read_timer();
     }
 
+#if !TEST
+    // ranking and fitting are shared, only compositing runs again per level
+    // the pyramid loads every placed component up front, so it is only built when asked for
+    if (PREVIEW_LEVELS > 0 && SHARD_COUNT <= 1) {
+        dbgprint(1, "\n\nStarting Preview Write");
+        write_preview_imgs();
+        if (TIMESTEPS) {
+            printf("Time taken  [%g seconds]", read_timer() - time_step);
+            time_step = read_timer();
+        }
+    }
+#endif
+
     dbgprint(1, "\n\nStarting Mosaic Write");
 #if !TEST
-    // place tiles
-    // writing full image uses more memory but is significantly faster
-    // (bottle neck with FILTER == 1)
-    write_full_img();
+    write_mosaic();
 #endif
+    tint_cache_report();
     dbgprint(1, "Done Mosaic Write");
     if (TIMESTEPS) {
         printf("Time taken  [%g seconds]", read_timer() - time_step);
         time_step = read_timer();
     }
 
+    trace_write();
     program_time = read_timer() - program_time;
 
     cout << "\n\nFinished Mosaic \n\n";
     printf("Program time = %g seconds", program_time);
     return 0;
+}
+
+
+/***********************************************/
+/*************** BENCH FUNCTIONS ***************/
+/***********************************************/
+
+// next value of the benchmark random generator
+// a plain 64 bit LCG so a seed gives the same library with every compiler and libc
+inline unsigned int bench_rand(unsigned long long& state)
+{
+    state = state * 6364136223846793005ULL + 1442695040888963407ULL;
+    return (unsigned int) (state >> 33);
+}
+
+// fills a component with a seeded color gradient plus noise
+// every component gets its own base color and direction so rankings are not all ties
+void bench_paint(bitmap_image& image, unsigned long long& state)
+{
+    int base[3], slope_x[3], slope_y[3];
+    for (int c = 0; c < 3; c++) {
+        base[c] = bench_rand(state) % 256;
+        slope_x[c] = (int) (bench_rand(state) % 129) - 64;
+        slope_y[c] = (int) (bench_rand(state) % 129) - 64;
+    }
+
+    int w = image.width(), h = image.height();
+    for (int y = 0; y < h; y++) {
+        unsigned char* bgr = image.row(y);
+        for (int x = 0; x < w; x++, bgr += 3)
+            for (int c = 0; c < 3; c++) {
+                int value = base[c] + slope_x[c] * x / w + slope_y[c] * y / h + (int) (bench_rand(state) % 25) - 12;
+                bgr[2 - c] = (unsigned char) min_n(max_n(value, 0), 255);
+            }
+    }
+}
+
+// writes BENCH_COMPONENTS synthetic components and a BENCH_REF_WIDTH x BENCH_REF_HEIGHT reference
+// to BENCH_DIR and points FILE_REF, FILE_OUT and DIR_IMG_PATH at them
+// components are seeded one by one, a library of N is the first N files of any bigger one
+// returns 0 for success, 1 for failure
+int bench_generate()
+{
+    string img_dir = BENCH_DIR + "/img";
+    mkdir(BENCH_DIR.c_str(), 0755);
+    mkdir(img_dir.c_str(), 0755);
+
+    // components past BENCH_COMPONENTS left from a bigger library would be listed too
+    struct dirent **files;
+    int n = scandir(img_dir.c_str(), &files, NULL, alphasort);
+    if (n < 0) {
+        dbgprint(0, "ERROR: Cannot create " + img_dir);
+        return 1;
+    }
+    for (int i = 0; i < n; i++) {
+        int img = -1;
+        if (sscanf(files[i]->d_name, "cmp_%d.bmp", &img) == 1 && img >= BENCH_COMPONENTS)
+            unlink((img_dir + "/" + files[i]->d_name).c_str());
+        free(files[i]);
+    }
+    free(files);
+
+    for (int img = 0; img < BENCH_COMPONENTS; img++) {
+        unsigned long long state = ((unsigned long long) BENCH_SEED << 32) ^ ((img + 1) * 0x9E3779B97F4A7C15ULL);
+        // sizes vary a little like a real library, the smallest one sets the crop
+        unsigned int w = 64 + bench_rand(state) % 17;
+        unsigned int h = 48 + bench_rand(state) % 13;
+        bitmap_image image(w, h);
+        bench_paint(image, state);
+
+        char name[32];
+        snprintf(name, sizeof(name), "/cmp_%06d.bmp", img);
+        image.save_image(img_dir + name);
+    }
+
+    // the reference is a few overlapping color waves, smooth enough that neighbouring tiles compete
+    unsigned long long state = ((unsigned long long) BENCH_SEED << 32) ^ 0x5DEECE66DULL;
+    double freq_x[3], freq_y[3], phase[3];
+    for (int c = 0; c < 3; c++) {
+        freq_x[c] = (1 + bench_rand(state) % 6) * 2 * M_PI / BENCH_REF_WIDTH;
+        freq_y[c] = (1 + bench_rand(state) % 6) * 2 * M_PI / BENCH_REF_HEIGHT;
+        phase[c] = (bench_rand(state) % 1000) * 2 * M_PI / 1000;
+    }
+
+    bitmap_image ref(BENCH_REF_WIDTH, BENCH_REF_HEIGHT);
+    for (int y = 0; y < BENCH_REF_HEIGHT; y++) {
+        unsigned char* bgr = ref.row(y);
+        for (int x = 0; x < BENCH_REF_WIDTH; x++, bgr += 3)
+            for (int c = 0; c < 3; c++) {
+                double wave = sin(x * freq_x[c] + phase[c]) * cos(y * freq_y[c] - phase[c]);
+                int value = (int) (128 + 110 * wave) + (int) (bench_rand(state) % 17) - 8;
+                bgr[2 - c] = (unsigned char) min_n(max_n(value, 0), 255);
+            }
+    }
+    ref.save_image(BENCH_DIR + "/ref.bmp");
+
+    FILE_REF = BENCH_DIR + "/ref.bmp";
+    FILE_OUT = BENCH_DIR + "/mosaic.bmp";
+    DIR_IMG_PATH = img_dir;
+
+    string output = "Done writing " + to_string(BENCH_COMPONENTS) + " synthetic components and a ";
+    output += to_string(BENCH_REF_WIDTH) + " x " + to_string(BENCH_REF_HEIGHT) + " reference to " + BENCH_DIR;
+    dbgprint(1, output);
+    return 0;
+}
+
+// size of a file in bytes, 0 if it cannot be read
+long long bench_file_size(const string& path)
+{
+    struct stat st;
+    return stat(path.c_str(), &st) == 0 ? (long long) st.st_size : 0;
+}
+
+// nearest rank percentile
+// sorted: samples in ascending order
+// p: fraction between 0 and 1
+double bench_percentile(const vector<double>& sorted, double p)
+{
+    size_t rank = (size_t) ceil(p * sorted.size());
+    return sorted[rank > 0 ? rank - 1 : 0];
+}
+
+// times every phase of a render on its own reps times and writes the results as JSON
+// phases run in render order, every rep starts them from the same state:
+// index probes every header again (FILE_INDEX is not used), weighing decodes every component again
+// files are read warm from the page cache after the first rep
+// returns 0 for success, 1 for failure
+int bench_run(int reps)
+{
+    FILE_INDEX = "";
+    FILE_FIT = "";
+    FILE_RANK = "";
+    rank_hash = 0;
+    trace_reset();
+
+    vector <bench_phase> phases(6);
+    const char* names[6] = { "index", "ref_weights", "cmp_weights", "rank", "fit", "write" };
+    for (int p = 0; p < 6; p++)
+        phases[p].name = names[p];
+
+    for (int rep = 0; rep < reps; rep++) {
+        dbgprint(1, "\n\nStarting Benchmark Rep " + to_string(rep + 1) + " of " + to_string(reps));
+        double time_step;
+
+        components_dir.clear();
+        time_step = read_timer();
+        components_size = get_component_file_list();
+        phases[0].times.push_back(read_timer() - time_step);
+        if (components_size == 0)
+            return 1;
+
+        TOTAL_TILES = TILE_COUNT > 0 ? TILE_COUNT : TILE_LDA * TILE_LDA;
+        tile_map.clear();
+        time_step = read_timer();
+        if (get_mosaic_metadata(TOTAL_TILES))
+            return 1;
+        phases[1].times.push_back(read_timer() - time_step);
+
+        for (int img = 0; img < components_size; img++)
+            components[img].weighed = 0;
+        tile_cache_stride = 0;
+        time_step = read_timer();
+        get_component_file_weight();
+        phases[2].times.push_back(read_timer() - time_step);
+
+        time_step = read_timer();
+        rank_all_tiles();
+        phases[3].times.push_back(read_timer() - time_step);
+
+        fit_reset();
+        time_step = read_timer();
+        fit_tiles();
+        phases[4].times.push_back(read_timer() - time_step);
+
+#if !TEST
+        time_step = read_timer();
+#if WRITE_MODE == 0
+        write_bmp_template();
+#endif
+        write_mosaic();
+        phases[5].times.push_back(read_timer() - time_step);
+#endif
+    }
+
+    // what each phase moves through, MB/s is left out for phases that only compute
+    long long cmp_bytes = 0;
+    for (int img = 0; img < components_size; img++)
+        cmp_bytes += components[img].size;
+    phases[0].items = components_size;
+    phases[1].items = TOTAL_TILES;
+    phases[1].bytes = bench_file_size(FILE_REF);
+    phases[2].items = components_size;
+    phases[2].bytes = cmp_bytes;
+    phases[3].items = phases[4].items = phases[5].items = TOTAL_TILES;
+    phases[5].bytes = bench_file_size(FILE_OUT);
+    phases[0].unit = phases[2].unit = "components";
+    phases[1].unit = phases[3].unit = phases[4].unit = phases[5].unit = "tiles";
+
+    // color error of the placements, lower is better, catches fitting regressions
+    long long fit_error = 0;
+    for (int t = 0; t < TOTAL_TILES; t++) {
+        if (tile_img[t] < 0)
+            continue;
+        float query[3];
+        color_convert(tile_rgb[t], query);
+        fit_error += fit_cost(query, tile_img[t]);
+    }
+
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+
+    char line[512];
+    string json = "{\n";
+    snprintf(line, sizeof(line), "  \"config\": {\"components\": %d, \"tiles\": %d, \"rows\": %d, \"cols\": %d, "
+             "\"repeat\": %d, \"dist\": %d, \"threads\": %d, \"io_threads\": %d, \"reps\": %d, \"synth_seed\": %d, "
+             "\"rank_mode\": %d, \"fit_mode\": %d, \"write_mode\": %d, \"gpu_offload\": %d},\n",
+             components_size, TOTAL_TILES, mosaic.rows, mosaic.cols, TILE_RPT_COUNT, TILE_MIN_DIST, numthreads,
+             IO_THREADS, reps, BENCH_COMPONENTS > 0 ? BENCH_SEED : 0, RANK_MODE, FIT_MODE, WRITE_MODE, GPU_OFFLOAD);
+    json += line;
+    json += "  \"phases\": [\n";
+    for (size_t p = 0; p < phases.size(); p++) {
+        vector <double> sorted = phases[p].times;
+        if (sorted.empty())
+            continue;
+        sort(sorted.begin(), sorted.end());
+        double median = bench_percentile(sorted, 0.5);
+        double p95 = bench_percentile(sorted, 0.95);
+        double rate = median > 0 ? phases[p].items / median : 0;
+
+        snprintf(line, sizeof(line), "    {\"phase\": \"%s\", \"median_s\": %.6f, \"p95_s\": %.6f, "
+                 "\"%s\": %lld, \"%s_per_s\": %.1f, ",
+                 phases[p].name.c_str(), median, p95, phases[p].unit.c_str(), phases[p].items, phases[p].unit.c_str(), rate);
+        json += line;
+        if (phases[p].bytes > 0 && median > 0)
+            snprintf(line, sizeof(line), "\"mb_per_s\": %.1f}", phases[p].bytes / median / (1024.0 * 1024.0));
+        else
+            snprintf(line, sizeof(line), "\"mb_per_s\": null}");
+        json += line;
+        json += p + 1 < phases.size() && !phases[p + 1].times.empty() ? ",\n" : "\n";
+    }
+    json += "  ],\n";
+    // ru_maxrss is in kilobytes on linux (bytes on macOS)
+    snprintf(line, sizeof(line), "  \"fit_error\": %lld,\n  \"peak_rss_kb\": %ld\n}\n", fit_error, (long) usage.ru_maxrss);
+    json += line;
+
+    string file_name = FILE_BENCH;
+    if (file_name.empty())
+        file_name = FILE_OUT.substr(0, FILE_OUT.find_last_of('/') + 1) + "bench.json";
+    ofstream stream(file_name.c_str());
+    stream << json;
+    if (!stream) {
+        dbgprint(0, "ERROR: Cannot write benchmark report " + file_name);
+        return 1;
+    }
+
+    cout << "\n\n" << json;
+    dbgprint(1, "Done Benchmark: " + file_name);
+    trace_write();
+    return 0;
+}
+
+
+/************************************************/
+/*************** CONFIG FUNCTIONS ***************/
+/************************************************/
+
+// sets one run time setting, used for command line options and batch job lines
+// key: setting name (ref, out, dir, index, fit_cache, rank_cache, batch, tiles, count, repeat, dist, threads, io_threads,
+//      filter, filter_percent, asp_err, previews, tint_cache_mb, png_level, bench, bench_out, synth, synth_dir,
+//      synth_seed, synth_width, synth_height, trace, shards, shard, merge)
+// value: new value
+// returns 0 for success, 1 for an unknown key or a bad value
+int config_set(const string& key, const string& value)
+{
+    char* end = NULL;
+    long number = strtol(value.c_str(), &end, 10);
+    int is_number = !value.empty() && *end == '\0';
+    double real = strtod(value.c_str(), &end);
+    int is_real = !value.empty() && *end == '\0';
+
+    if (key == "ref") {
+        // the fit and rank caches follow the reference unless they are given after it
+        FILE_REF = value;
+        FILE_FIT = FILE_REF + ".fit";
+        FILE_RANK = FILE_REF + ".rank";
+    }
+    else if (key == "out")
+        FILE_OUT = value;
+    else if (key == "dir") {
+        // the index follows the library unless one is given after it
+        DIR_IMG_PATH = value;
+        FILE_INDEX = DIR_IMG_PATH + ".idx";
+    }
+    else if (key == "index")
+        FILE_INDEX = value;
+    else if (key == "fit_cache")
+        FILE_FIT = value;
+    else if (key == "rank_cache")
+        FILE_RANK = value;
+    else if (key == "batch")
+        FILE_BATCH = value;
+    else if (key == "tiles" && is_number && number > 0)
+        TILE_LDA = number;
+    else if (key == "count" && is_number && number >= 0)
+        TILE_COUNT = number;
+    else if (key == "repeat" && is_number && number > 0)
+        TILE_RPT_COUNT = number;
+    else if (key == "dist" && is_number && number >= 0)
+        TILE_MIN_DIST = number;
+    else if (key == "threads" && is_number && number > 0)
+        numthreads = number;
+    else if (key == "io_threads" && is_number && number > 0)
+        IO_THREADS = number;
+    else if (key == "filter" && is_number)
+        FILTER = number != 0;
+    else if (key == "filter_percent" && is_real && real >= 0 && real <= 1)
+        FILTER_PERCENT = real;
+    else if (key == "asp_err" && is_real && real >= 0)
+        ASP_RATIO_ERR = real;
+    else if (key == "previews" && is_number && number >= 0)
+        PREVIEW_LEVELS = number;
+    else if (key == "tint_cache_mb" && is_number && number >= 0)
+        TINT_CACHE_MB = number;
+    else if (key == "png_level" && is_number && number >= 1 && number <= 9)
+        PNG_LEVEL = number;
+    else if (key == "bench" && is_number && number >= 0)
+        BENCH_REPS = number;
+    else if (key == "bench_out")
+        FILE_BENCH = value;
+    else if (key == "trace")
+        FILE_TRACE = value;
+    else if (key == "shards" && is_number && number > 0)
+        SHARD_COUNT = number;
+    else if (key == "shard" && is_number && number >= 0)
+        SHARD_INDEX = number;
+    else if (key == "merge" && is_number)
+        SHARD_MERGE = number != 0;
+    else if (key == "synth" && is_number && number >= 0)
+        BENCH_COMPONENTS = number;
+    else if (key == "synth_dir")
+        BENCH_DIR = value;
+    else if (key == "synth_seed" && is_number)
+        BENCH_SEED = number;
+    else if (key == "synth_width" && is_number && number > 0)
+        BENCH_REF_WIDTH = number;
+    else if (key == "synth_height" && is_number && number > 0)
+        BENCH_REF_HEIGHT = number;
+    else {
+        dbgprint(0, "ERROR: Bad setting " + key + "=" + value);
+        return 1;
+    }
+    return 0;
+}
+
+// reads --key value and --key=value options into settings (dashes in a key may be underscores)
+// settings: receives the options in the order given
+// returns 0 for success, 1 for a malformed command line
+int config_parse_args(int argc, char** argv, vector<pair<string, string>>& settings)
+{
+    for (int i = 1; i < argc; i++) {
+        string arg = argv[i];
+        if (arg.compare(0, 2, "--") != 0) {
+            dbgprint(0, "ERROR: Expected an option, got " + arg);
+            return 1;
+        }
+
+        string key = arg.substr(2), value;
+        size_t eq = key.find('=');
+        if (eq != string::npos) {
+            value = key.substr(eq + 1);
+            key.resize(eq);
+        }
+        else if (i + 1 < argc)
+            value = argv[++i];
+        else {
+            dbgprint(0, "ERROR: Missing value for " + arg);
+            return 1;
+        }
+
+        replace(key.begin(), key.end(), '-', '_');
+        settings.push_back(make_pair(key, value));
+    }
+    return 0;
+}
+
+// current value of every setting config_set() can change
+run_config config_get()
+{
+    run_config config;
+    config.ref = FILE_REF;
+    config.out = FILE_OUT;
+    config.dir = DIR_IMG_PATH;
+    config.index = FILE_INDEX;
+    config.fit = FILE_FIT;
+    config.rank = FILE_RANK;
+    config.tiles = TILE_LDA;
+    config.count = TILE_COUNT;
+    config.repeat = TILE_RPT_COUNT;
+    config.dist = TILE_MIN_DIST;
+    config.threads = numthreads;
+    config.io_threads = IO_THREADS;
+    config.filter = FILTER;
+    config.previews = PREVIEW_LEVELS;
+    config.tint_cache_mb = TINT_CACHE_MB;
+    config.png_level = PNG_LEVEL;
+    config.filter_percent = FILTER_PERCENT;
+    config.asp_err = ASP_RATIO_ERR;
+    config.shards = SHARD_COUNT;
+    config.shard = SHARD_INDEX;
+    return config;
+}
+
+// puts back settings taken with config_get()
+void config_put(const run_config& config)
+{
+    FILE_REF = config.ref;
+    FILE_OUT = config.out;
+    DIR_IMG_PATH = config.dir;
+    FILE_INDEX = config.index;
+    FILE_FIT = config.fit;
+    FILE_RANK = config.rank;
+    TILE_LDA = config.tiles;
+    TILE_COUNT = config.count;
+    TILE_RPT_COUNT = config.repeat;
+    TILE_MIN_DIST = config.dist;
+    numthreads = config.threads;
+    IO_THREADS = config.io_threads;
+    FILTER = config.filter;
+    PREVIEW_LEVELS = config.previews;
+    TINT_CACHE_MB = config.tint_cache_mb;
+    PNG_LEVEL = config.png_level;
+    FILTER_PERCENT = config.filter_percent;
+    ASP_RATIO_ERR = config.asp_err;
+    SHARD_COUNT = config.shards;
+    SHARD_INDEX = config.shard;
+}
+
+// applies settings in order, returns 0 for success, 1 if any of them was rejected
+int config_apply(const vector<pair<string, string>>& settings)
+{
+    int failed = 0;
+    for (size_t n = 0; n < settings.size(); n++)
+        failed |= config_set(settings[n].first, settings[n].second);
+    return failed;
+}
+
+// renders every job of a batch file in one process
+// every line is a list of key=value settings applied on top of the command line ones,
+// blank lines and lines starting with # are skipped
+// jobs on the same library share its index, tile cache and the OpenMP thread team
+// returns number of jobs that failed
+int render_batch(const string& file_name)
+{
+    // every job starts from the command line settings, not from the job before it
+    run_config defaults = config_get();
+
+    ifstream stream(file_name.c_str());
+    if (!stream) {
+        dbgprint(0, "ERROR: Cannot open batch file " + file_name);
+        return 1;
+    }
+
+    vector <vector<pair<string, string>>> jobs;
+    string line;
+    while (getline(stream, line)) {
+        size_t start = line.find_first_not_of(" \t\r");
+        if (start == string::npos || line[start] == '#')
+            continue;
+
+        vector <pair<string, string>> job;
+        size_t pos = start;
+        while (pos < line.size()) {
+            size_t stop = line.find_first_of(" \t\r", pos);
+            if (stop == string::npos)
+                stop = line.size();
+            string token = line.substr(pos, stop - pos);
+            size_t eq = token.find('=');
+            if (!token.empty())
+                job.push_back(eq == string::npos ? make_pair(token, string()) : make_pair(token.substr(0, eq), token.substr(eq + 1)));
+            pos = line.find_first_not_of(" \t\r", stop);
+            if (pos == string::npos)
+                break;
+        }
+        jobs.push_back(job);
+    }
+
+    int failed = 0;
+    for (size_t n = 0; n < jobs.size(); n++) {
+        config_put(defaults);
+        if (config_apply(jobs[n])) {
+            dbgprint(0, "ERROR: Skipping job " + to_string(n + 1));
+            failed++;
+            continue;
+        }
+
+        dbgprint(1, "\n\nStarting Job " + to_string(n + 1) + " of " + to_string(jobs.size()) + ": " + FILE_REF + " -> " + FILE_OUT);
+        failed += render_mosaic() != 0;
+    }
+
+    string output = "\n\nDone Batch: " + to_string(jobs.size() - failed) + " of " + to_string(jobs.size()) + " mosaics written";
+    dbgprint(1, output);
+    return failed;
+}
+
+
+/************************************/
+/*************** MAIN ***************/
+/************************************/
+
+int main(int argc, char** argv)
+{
+    vector <pair<string, string>> settings;
+    if (config_parse_args(argc, argv, settings) || config_apply(settings))
+        return 1;
+
+    // a synthetic library replaces the FILES settings, on its own it is only written out
+    if (BENCH_COMPONENTS > 0) {
+        if (bench_generate())
+            return 1;
+        if (BENCH_REPS == 0)
+            return 0;
+    }
+    if (BENCH_REPS > 0)
+        return bench_run(BENCH_REPS);
+    if (SHARD_MERGE)
+        return merge_shards();
+    if (!FILE_BATCH.empty())
+        return render_batch(FILE_BATCH) ? 1 : 0;
+    return render_mosaic();
 }
\ No newline at end of file
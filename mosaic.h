@@ -1,6 +1,13 @@
 #pragma once
 
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
 #include <string>
+#include <vector>
 
 typedef struct mosaic_metadata
 {
@@ -17,28 +24,250 @@ typedef struct mosaic_metadata
 	unsigned int cmp_height;
 };
 
+// number of times a component has been placed
+// shared by the fitting threads, try_claim() checks the limit and increments in one step
+struct placed_counter
+{
+	std::atomic<int> value;
+
+	placed_counter(int v = 0) : value(v) {}
+	placed_counter(const placed_counter& other) : value(other.value.load()) {}
+	placed_counter& operator=(const placed_counter& other) { value.store(other.value.load()); return *this; }
+	placed_counter& operator=(int v) { value.store(v); return *this; }
+	operator int() const { return value.load(std::memory_order_relaxed); }
+
+	// takes one placement if fewer than limit are taken
+	// returns the placement number taken (0 for the first), -1 if the limit was reached
+	int try_claim(int limit)
+	{
+		int cur = value.load(std::memory_order_relaxed);
+		while (cur < limit)
+			if (value.compare_exchange_weak(cur, cur + 1))
+				return cur;
+		return -1;
+	}
+
+	// takes one placement regardless of the limit, returns the placement number taken
+	int force_claim() { return value.fetch_add(1); }
+};
+
+// cold data of a component, its color and placed count live in component_rgb and component_placed
 typedef struct component_metadata
 {
 	unsigned int width;
 	unsigned int height;
-	rgb_t rgb;
 	std::string path;
-	int placed = 0;
+	// file stamp used to validate the on-disk component index
+	long long mtime = 0;
+	long long size = 0;
+	// 1 when rgb is already valid for the current crop size
+	int weighed = 0;
 };
 
-typedef struct mosaic_tile
+typedef struct component_index_entry
 {
-	size_t start_x;
-	size_t start_y;
-	int img_index;
+	long long mtime;
+	long long size;
+	unsigned int width;
+	unsigned int height;
+	// RMS weight at the crop size stored in the index header
 	rgb_t rgb;
-	// just testing with end vars
-	//size_t end_x;
-	//size_t end_y;
+	int weighed;
 };
 
+// 6 bytes per entry, tile_map holds one for every component of every tile
+#pragma pack(push, 2)
 typedef struct mosaic_map
 {
-	int index;	// index to component_metadata image
-	int value;	// RMS value of the image
-};
\ No newline at end of file
+	uint32_t index;	// index to component_metadata image
+	uint16_t value;	// color distance of the image (rank_score())
+};
+#pragma pack(pop)
+
+typedef struct kd_node
+{
+	// component stored at the split point of this subtree
+	int index;
+	// split axis (0 red, 1 green, 2 blue)
+	int axis;
+	// bounding box of every component color in this subtree
+	float min[3];
+	float max[3];
+};
+
+typedef struct kd_candidate
+{
+	float dist;	// squared distance (lower bound for a subtree)
+	int lo;		// first node of the subtree, or the node of a single component
+	int hi;		// one past the last node, -1 for a single component
+};
+
+typedef struct kd_cursor
+{
+	// tile color we are searching around (COLOR_SPACE coordinates)
+	float query[3];
+	// min heap of subtrees and components still to visit
+	std::vector<kd_candidate> heap;
+};
+
+typedef struct rank_cursor
+{
+	int tile_index;
+	// position in tile_map (RANK_MODE 0)
+	int n;
+	// nearest neighbour search state (RANK_MODE 1)
+	kd_cursor kd;
+};
+
+typedef struct auction_bid
+{
+	long long amount;	// price offered for one placement of the component
+	int tile_index;		// bidding tile, -1 when the tile made no bid
+	int candidate;		// position of the component in the tile's candidate list
+};
+
+// every render setting that can be changed at run time (config_set()), batch jobs restore it between jobs
+typedef struct run_config
+{
+	std::string ref;
+	std::string out;
+	std::string dir;
+	std::string index;
+	std::string fit;
+	std::string rank;
+	int tiles;
+	int count;
+	int repeat;
+	int dist;
+	int threads;
+	int io_threads;
+	int filter;
+	int previews;
+	int tint_cache_mb;
+	int png_level;
+	float filter_percent;
+	float asp_err;
+	int shards;
+	int shard;
+};
+
+// a span of traced work on one thread (TRACE 1), times in seconds from read_timer()
+typedef struct trace_event
+{
+	const char* name;
+	double start;
+	double dur;
+	// number of back to back spans merged into this one
+	int count = 1;
+	// 1 for a whole phase (trace_scope), 0 for work done by the thread
+	int phase = 0;
+};
+
+// counters and events of one traced thread, only ever written by that thread
+typedef struct trace_thread
+{
+	int tid = 0;
+	const char* name = "worker";
+	// position among the threads of that name (trace_adopt()), -1 if the slot is not reused
+	int ordinal = -1;
+	std::vector<trace_event> events;
+	// open span of trace_begin(), open is 1 until trace_end()
+	const char* open_name = "";
+	double open_start = 0;
+	int open = 0;
+	// 1 if trace_wait_begin() closed an open span that trace_wait_end() reopens
+	int waiting = 0;
+	// seconds spent inside trace_begin() / trace_end() spans
+	double busy = 0;
+	// candidates taken off the ranking, repeat checks and the placements they compared
+	long long candidates = 0;
+	long long checks = 0;
+	long long probes = 0;
+	// picks made and how deep into the ranking, bucket n holds depths [2^n, 2^(n+1))
+	long long picks = 0;
+	long long depth[32] = { 0 };
+};
+
+// timings of one benchmarked phase (bench_run())
+typedef struct bench_phase
+{
+	std::string name;
+	// what items counts, tiles or components
+	std::string unit;
+	long long items = 0;
+	// bytes read or written per run, 0 for phases that only compute
+	long long bytes = 0;
+	// seconds taken by every rep
+	std::vector<double> times;
+};
+
+typedef struct tile_level
+{
+	// size of every component at this level of the pyramid
+	unsigned int width;
+	unsigned int height;
+	// bytes per component, components are back to back like the tile cache
+	size_t stride;
+	std::vector<unsigned char> pixels;
+};
+// tasks [next, end) still owned by one thread of pool_for(), other threads steal from the back
+// one per cache line so owners taking tasks do not slow each other down
+struct alignas(64) steal_range
+{
+	std::mutex lock;
+	int next = 0;
+	int end = 0;
+};
+
+// component image decoded by a loader thread, waiting to be cropped into the tile cache
+typedef struct decoded_component
+{
+	int img_index;
+	std::unique_ptr<bitmap_image> image;
+};
+
+// fixed capacity queue between the loader threads and the workers
+// push() blocks while full so readers never run more than capacity images ahead
+template <typename T>
+class bounded_queue
+{
+public:
+	explicit bounded_queue(size_t capacity) : capacity_(capacity ? capacity : 1), closed_(false) {}
+
+	void push(T item)
+	{
+		std::unique_lock<std::mutex> lock(lock_);
+		not_full_.wait(lock, [this] { return items_.size() < capacity_; });
+		items_.push_back(std::move(item));
+		not_empty_.notify_one();
+	}
+
+	// waits for an item, returns false once the queue is closed and drained
+	bool pop(T& item)
+	{
+		std::unique_lock<std::mutex> lock(lock_);
+		not_empty_.wait(lock, [this] { return !items_.empty() || closed_; });
+		if (items_.empty())
+			return false;
+		item = std::move(items_.front());
+		items_.pop_front();
+		not_full_.notify_one();
+		return true;
+	}
+
+	// no more pushes will come, wakes every waiting pop()
+	void close()
+	{
+		std::lock_guard<std::mutex> lock(lock_);
+		closed_ = true;
+		not_empty_.notify_all();
+	}
+
+private:
+	std::mutex lock_;
+	std::condition_variable not_full_;
+	std::condition_variable not_empty_;
+	std::deque<T> items_;
+	size_t capacity_;
+	bool closed_;
+};